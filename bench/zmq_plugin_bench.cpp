@@ -0,0 +1,299 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#include "zmq_plugin_impl.hpp"
+#include <fc/exception/exception.hpp>
+#include <iostream>
+
+namespace bpo = boost::program_options;
+namespace bfs = boost::filesystem;
+
+namespace eosio {
+  using namespace chain;
+  using namespace zmqplugin;
+
+  // Stand-in chain state for the benchmark: ABIs come from the fixture,
+  // and the balances are synthetic values of realistic size.
+  class fixture_state : public chain_state {
+  public:
+    block_num_type head_block_num() const override { return head; }
+    block_num_type last_irreversible_block_num() const override { return head; }
+
+    // accounts without a recorded ABI are treated as nonexistent
+    bool get_abi_sequence(name account, uint64_t& abi_sequence) const override
+    {
+      auto it = abis.find(account.value);
+      if( it == abis.end() ) {
+        return false;
+      }
+      abi_sequence = it->second.abi_sequence;
+      return true;
+    }
+
+    bytes get_abi(name account) const override
+    {
+      auto it = abis.find(account.value);
+      return (it != abis.end()) ? it->second.abi : bytes();
+    }
+
+    resource_balance get_resource_balance(name account) const override
+    {
+      resource_balance bal;
+      bal.account_name = account;
+      bal.ram_quota = 8192 + (account.value % 100000);
+      bal.ram_usage = 4096 + (account.value % 4096);
+      bal.net_weight = 10000 + (account.value % 1000000);
+      bal.cpu_weight = 10000 + (account.value % 1000000);
+      bal.net_limit = account_resource_limit{100, 100000, 100000};
+      bal.cpu_limit = account_resource_limit{100, 100000, 100000};
+      return bal;
+    }
+
+    vector<currency_balance> get_currency_balances(name account, name token_code) const override
+    {
+      return { currency_balance{account, token_code, asset(int64_t(account.value % 100000000), symbol(4, "TKN"))} };
+    }
+
+    // snapshots are not part of the benchmark
+    vector<name> get_accounts() const override { return vector<name>(); }
+    vector<name> get_token_holders(name) const override { return vector<name>(); }
+
+    vector<zmq_table_delta> get_table_deltas(block_num_type, const std::set<name>&) const override
+    {
+      return vector<zmq_table_delta>();
+    }
+
+    block_num_type                            head = 0;
+    std::unordered_map<uint64_t, fixture_abi> abis;
+  };
+
+
+  // Encodes every action trace of the fixture with both JSON writers, with
+  // synthetic balances, and reports the actions whose output differs.
+  // Returns the process exit code.
+  int verify_json(zmq_plugin_impl& my, const vector<transaction_trace_ptr>& traces)
+  {
+    auto resolver = [&my](const account_name& n) { return my.resolve_abi(n); };
+    uint64_t actions = 0;
+    uint64_t mismatches = 0;
+    for( const auto& trace : traces ) {
+      for( const auto& at : trace->action_traces ) {
+        zmq_action_object zao;
+        zao.global_action_seq = at.receipt.global_sequence;
+        zao.block_num = trace->block_num;
+        zao.block_time = trace->block_time;
+        zao.resource_balances.emplace_back(my.state->get_resource_balance(at.receiver));
+        zao.currency_balances = my.state->get_currency_balances(at.receiver, at.act.account);
+        zao.last_irreversible_block = trace->block_num;
+
+        string streaming;
+        json_writer(streaming).action_object(zao, at, resolver, my.abi_serializer_max_time);
+        abi_serializer::to_variant(at, zao.action_trace, resolver, my.abi_serializer_max_time);
+        const string variant = fc::json::to_string(zao);
+
+        ++actions;
+        if( streaming != variant ) {
+          if( ++mismatches <= 10 ) {
+            elog("JSON writers differ for action ${s} of transaction ${t}:\nstreaming: ${a}\nvariant:   ${b}",
+                 ("s", zao.global_action_seq)("t", trace->id)("a", streaming)("b", variant));
+          }
+        }
+      }
+    }
+    std::cout << fc::json::to_pretty_string(fc::mutable_variant_object()
+                                            ("actions", actions)
+                                            ("mismatches", mismatches))
+              << std::endl;
+    return mismatches == 0 ? 0 : 1;
+  }
+
+
+  // Replays a fixture recorded with zmq-record-fixture through the plugin
+  // pipeline configured with the given plugin options, sending to inproc
+  // sockets, and prints the throughput and the pipeline metrics. With
+  // verify, compares the JSON writers on the fixture instead.
+  // Returns the process exit code.
+  int run_benchmark(const variables_map& options, const bfs::path& fixture, uint32_t iterations, bool verify)
+  {
+    // the fixture is loaded into memory beforehand
+    std::unique_ptr<fixture_state> state(new fixture_state());
+    vector<transaction_trace_ptr> traces;
+    vector<signed_block_ptr> blocks;
+    vector<std::pair<fixture_record_type, size_t>> events;
+    {
+      std::ifstream in(fixture.generic_string(), std::ios::binary);
+      EOS_ASSERT( in.good(), plugin_config_exception, "Cannot open ${f}", ("f", fixture.generic_string()) );
+      vector<char> payload;
+      while( true ) {
+        uint8_t type;
+        uint32_t size;
+        if( !in.read((char*) &type, sizeof(type)) || !in.read((char*) &size, sizeof(size)) ) {
+          break;
+        }
+        payload.resize(size);
+        EOS_ASSERT( in.read(payload.data(), size), plugin_config_exception,
+                    "Truncated fixture record in ${f}", ("f", fixture.generic_string()) );
+        switch( type ) {
+        case FIXTURE_TRACE:
+          traces.emplace_back(std::make_shared<transaction_trace>(fc::raw::unpack<transaction_trace>(payload)));
+          events.emplace_back(FIXTURE_TRACE, traces.size() - 1);
+          break;
+        case FIXTURE_BLOCK:
+          blocks.emplace_back(std::make_shared<signed_block>(fc::raw::unpack<signed_block>(payload)));
+          events.emplace_back(FIXTURE_BLOCK, blocks.size() - 1);
+          break;
+        case FIXTURE_ABI:
+          {
+            auto abi = fc::raw::unpack<fixture_abi>(payload);
+            state->abis[abi.account.value] = std::move(abi);
+          }
+          break;
+        default:
+          EOS_ASSERT( false, plugin_config_exception, "Unknown fixture record type ${t}", ("t", type) );
+        }
+      }
+    }
+    ilog("Loaded ${b} blocks, ${t} traces and ${a} ABIs from ${f}",
+         ("b", blocks.size())("t", traces.size())("a", state->abis.size())("f", fixture.generic_string()));
+
+    std::unique_ptr<zmq_plugin_impl> my(new zmq_plugin_impl());
+    EOS_ASSERT( options.at("zmq-sender-type").as<string>() != "router", plugin_config_exception,
+                "The benchmark does not support zmq-sender-type = router" );
+    if( !my->configure(options) ) {
+      return 1;
+    }
+    my->abi_serializer_max_time = fc::seconds(1);
+    auto* standin = state.get();
+    my->state = std::move(state);
+
+    if( verify ) {
+      const int result = verify_json(*my, traces);
+      my->shutdown();
+      return result;
+    }
+
+    // the sink drains the sender sockets in a separate thread
+    std::atomic<bool> sink_done{false};
+    std::atomic<uint64_t> received{0};
+    std::thread sink([&]{
+        const int type = my->pub_mode ? ZMQ_SUB : ZMQ_PULL;
+        vector<std::unique_ptr<zmq::socket_t>> sockets;
+        vector<zmq::pollitem_t> items;
+        for( const auto& out : my->outputs ) {
+          sockets.emplace_back(new zmq::socket_t(my->context, type));
+          if( type == ZMQ_SUB ) {
+            sockets.back()->setsockopt(ZMQ_SUBSCRIBE, "", 0);
+          }
+          sockets.back()->connect(out->endpoint());
+          items.push_back(zmq::pollitem_t{ (void*) *sockets.back(), 0, ZMQ_POLLIN, 0 });
+        }
+        while( !sink_done.load() ) {
+          zmq::poll(items.data(), items.size(), 100);
+          for( size_t i = 0; i < items.size(); ++i ) {
+            zmq::message_t msg;
+            while( sockets[i]->recv(&msg, ZMQ_DONTWAIT) ) {
+              if( !sockets[i]->getsockopt<int>(ZMQ_RCVMORE) ) {
+                ++received;
+              }
+            }
+          }
+        }
+      });
+
+    const auto start = fc::time_point::now();
+    for( uint32_t i = 0; i < iterations; ++i ) {
+      if( i > 0 ) {
+        // Each pass replays the same block numbers as a new stream, not as a
+        // fork of the previous pass: the pending columnar rows are sent, and
+        // the schemas and balances are sent again as in the first pass.
+        if( my->columnar_blocks > 0 ) {
+          my->send_columnar_batches();
+        }
+        my->forget_sent_state();
+        my->_end_block = 0;
+        standin->head = 0;
+      }
+      for( const auto& e : events ) {
+        if( e.first == FIXTURE_TRACE ) {
+          my->on_applied_transaction(traces[e.second]);
+          continue;
+        }
+        auto bs = std::make_shared<block_state>();
+        bs->block = blocks[e.second];
+        my->on_accepted_block(bs);
+        my->on_irreversible_block(bs);
+        standin->head = bs->block->block_num();
+      }
+    }
+    while( my->queue->size() > 0 || my->spilled_size.load() > 0 || !my->sender_idle.load() ) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const auto elapsed = fc::time_point::now() - start;
+
+    my->shutdown();
+    sink_done = true;
+    sink.join();
+
+    uint64_t messages = 0;
+    uint64_t bytes_sent = 0;
+    for( size_t t = 0; t < plugin_metrics::MSGTYPES; ++t ) {
+      messages += my->metrics.messages_sent[t].load();
+      bytes_sent += my->metrics.bytes_sent[t].load();
+    }
+    const double seconds = std::max<double>(elapsed.count(), 1) / 1e6;
+    std::cout << fc::json::to_pretty_string(fc::mutable_variant_object()
+                                            ("iterations", iterations)
+                                            ("blocks", blocks.size() * iterations)
+                                            ("seconds", seconds)
+                                            ("messages", messages)
+                                            ("messages_received", received.load())
+                                            ("bytes", bytes_sent)
+                                            ("messages_per_sec", messages / seconds)
+                                            ("bytes_per_sec", bytes_sent / seconds)
+                                            ("blocks_per_sec", blocks.size() * iterations / seconds)
+                                            ("metrics", my->metrics.to_variant(0)))
+              << std::endl;
+    return 0;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  try {
+    bpo::options_description cli("zmq_plugin_bench options");
+    cli.add_options()
+      ("help,h", "Print this help message and exit")
+      ("fixture", bpo::value<bfs::path>()->required(), "Fixture file recorded with zmq-record-fixture")
+      ("iterations", bpo::value<uint32_t>()->default_value(1), "Number of times the fixture is replayed")
+      ("verify-json", "Compare the streaming and variant JSON writers on every action of the fixture, and exit with an error if any output differs");
+
+    // all zmq_plugin options are accepted on the command line
+    bpo::options_description plugin_cli, plugin_cfg("zmq_plugin options");
+    eosio::zmq_plugin().set_program_options(plugin_cli, plugin_cfg);
+    cli.add(plugin_cfg);
+
+    bpo::variables_map options;
+    bpo::store(bpo::parse_command_line(argc, argv, cli), options);
+    if( options.count("help") ) {
+      std::cout << cli << std::endl;
+      return 0;
+    }
+    bpo::notify(options);
+
+    // unless specified, the messages go to an inproc socket
+    if( options.at("zmq-sender-bind").defaulted() ) {
+      options.at("zmq-sender-bind").value() = std::vector<std::string>{"inproc://zmq_plugin_bench"};
+    }
+
+    return eosio::run_benchmark(options, options.at("fixture").as<bfs::path>(),
+                                options.at("iterations").as<uint32_t>(), options.count("verify-json") > 0);
+  }
+  catch( const fc::exception& e ) {
+    std::cerr << e.to_detail_string() << std::endl;
+  }
+  catch( const std::exception& e ) {
+    std::cerr << e.what() << std::endl;
+  }
+  return 1;
+}
@@ -3,571 +3,406 @@
  *  @copyright defined in eos/LICENSE.txt
  *  @author cc32d9 <cc32d9@gmail.com>
  */
-#include <eosio/zmq_plugin/zmq_plugin.hpp>
-#include <string>
-#include <zmq.hpp>
-#include <fc/io/json.hpp>
-
-#include <eosio/chain/types.hpp>
-#include <eosio/chain/controller.hpp>
-#include <eosio/chain/trace.hpp>
-#include <eosio/chain_plugin/chain_plugin.hpp>
+#include "zmq_plugin_impl.hpp"
 
 namespace {
   const char* SENDER_BIND = "zmq-sender-bind";
   const char* SENDER_BIND_DEFAULT = "tcp://127.0.0.1:5556";
-  const int32_t MSGTYPE_ACTION_TRACE = 0;
-  const int32_t MSGTYPE_IRREVERSIBLE_BLOCK = 1;
-  const int32_t MSGTYPE_FORK = 2;
-  const int32_t MSGTYPE_ACCEPTED_BLOCK = 3;
-  const int32_t MSGTYPE_FAILED_TX = 4;
+  const char* SHARD_BY_OPT = "zmq-shard-by";
+  const char* SHARD_BY_DEFAULT = "contract";
+  const char* SENDER_TYPE_OPT = "zmq-sender-type";
+  const char* SENDER_TYPE_DEFAULT = "push";
+  const char* ROUTER_TIMEOUT_OPT = "zmq-router-timeout-sec";
+  const uint32_t ROUTER_TIMEOUT_DEFAULT = 30;
+  const char* ROUTER_MAX_PENDING_OPT = "zmq-router-max-pending";
+  const uint32_t ROUTER_MAX_PENDING_DEFAULT = 10000;
+  const char* QUEUE_SIZE_OPT = "zmq-queue-size";
+  const char* OVERFLOW_POLICY_OPT = "zmq-overflow-policy";
+  const char* OVERFLOW_POLICY_DEFAULT = "block";
+  const char* ENCODING_OPT = "zmq-encoding";
+  const char* ENCODING_DEFAULT = "json";
+  const char* JSON_WRITER_OPT = "zmq-json-writer";
+  const char* JSON_WRITER_DEFAULT = "variant";
+  const char* ABI_CACHE_SIZE_OPT = "zmq-abi-cache-size";
+  const uint32_t ABI_CACHE_SIZE_DEFAULT = 1000;
+  const char* TRACE_CACHE_MB_OPT = "zmq-trace-cache-mb";
+  const uint32_t TRACE_CACHE_MB_DEFAULT = 256;
+  const char* BATCH_OPT = "zmq-batch-blocks";
+  const char* COLUMNAR_BLOCKS_OPT = "zmq-columnar-blocks";
+  const char* IRREVERSIBLE_ONLY_OPT = "zmq-irreversible-only";
+  const char* SCHEMA_REGISTRY_OPT = "zmq-schema-registry";
+  const char* SERIALIZER_THREADS_OPT = "zmq-serializer-threads";
+  const char* WHITELIST_OPT = "zmq-whitelist";
+  const char* BLACKLIST_OPT = "zmq-blacklist";
+  const char* SYSTEM_ACCOUNT_OPT = "zmq-system-account";
+  const char* ACCOUNT_FIELDS_OPT = "zmq-account-fields";
+  const char* TOKEN_ACTION_OPT = "zmq-token-action";
+  const char* CONTROL_BIND_OPT = "zmq-control-bind";
+  const char* SNAPSHOT_CONTRACT_OPT = "zmq-snapshot-contract";
+  const char* DELTA_CONTRACT_OPT = "zmq-delta-contract";
+  const char* SNAPSHOT_ON_STARTUP_OPT = "zmq-snapshot-on-startup";
+  const char* SNAPSHOT_ON_REQUEST_OPT = "zmq-snapshot-on-request";
+  const char* SNAPSHOT_CHUNK_OPT = "zmq-snapshot-chunk-size";
+  const char* BALANCE_DELTA_OPT = "zmq-balance-delta";
+  const char* BALANCE_REFRESH_OPT = "zmq-balance-refresh-blocks";
+  const char* JOURNAL_DIR_OPT = "zmq-journal-dir";
+  const char* JOURNAL_SEGMENT_MB_OPT = "zmq-journal-segment-mb";
+  const uint32_t JOURNAL_SEGMENT_MB_DEFAULT = 256;
+  const char* JOURNAL_RETENTION_OPT = "zmq-journal-retention-blocks";
+  const char* JOURNAL_BIND_OPT = "zmq-journal-bind";
+  const char* COMPRESSION_OPT = "zmq-compression";
+  const char* COMPRESSION_DEFAULT = "none";
+  const char* COMPRESSION_LEVEL_OPT = "zmq-compression-level";
+  const char* RECORD_FIXTURE_OPT = "zmq-record-fixture";
+  const char* REVERSIBLE_BLOCKS_FILE = "zmq_reversible_blocks.bin";
+  const char* ZSTD_DICTIONARY_OPT = "zmq-zstd-dictionary";
 }
 
-namespace zmqplugin {
-  using namespace eosio;
-  using namespace eosio::chain;
-  using account_resource_limit = chain::resource_limits::account_resource_limit;
-
-  // these structures are not defined in contract_types.hpp, so we define them here
-  namespace syscontract {
-
-    struct buyrambytes {
-      account_name payer;
-      account_name receiver;
-      uint32_t bytes;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(buyrambytes);}
-    };
-
-    struct buyram {
-      account_name payer;
-      account_name receiver;
-      asset quant;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(buyram);}
-    };
-
-    struct sellram {
-      account_name account;
-      uint64_t bytes;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(sellram);}
-    };
-
-    struct delegatebw {
-      account_name from;
-      account_name receiver;
-      asset stake_net_quantity;
-      asset stake_cpu_quantity;
-      bool transfer;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(delegatebw);}
-    };
-
-    struct undelegatebw {
-      account_name from;
-      account_name receiver;
-      asset unstake_net_quantity;
-      asset unstake_cpu_quantity;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(undelegatebw);}
-    };
-
-    struct refund {
-      account_name owner;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(refund);}
-    };
-
-    struct regproducer {
-      account_name producer;
-      public_key_type producer_key;
-      string url;
-      uint16_t location;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(regproducer);}
-    };
-
-    struct unregprod {
-      account_name producer;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(unregprod);}
-    };
-
-    struct regproxy {
-      account_name proxy;
-      bool isproxy;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(regproxy);}
-    };
-
-    struct voteproducer {
-      account_name voter;
-      account_name proxy;
-      std::vector<account_name> producers;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(voteproducer);}
-    };
-
-    struct claimrewards {
-      account_name owner;
-      static account_name get_account() {return config::system_account_name;}
-      static action_name get_name() {return N(claimrewards);}
-    };
-  }
-
-  struct resource_balance {
-    name                       account_name;
-    int64_t                    ram_quota  = 0;
-    int64_t                    ram_usage = 0;
-    int64_t                    net_weight = 0;
-    int64_t                    cpu_weight = 0;
-    account_resource_limit     net_limit;
-    account_resource_limit     cpu_limit;
-  };
-
-  struct currency_balance {
-    name                       account_name;
-    name                       contract;
-    asset                      balance;
-  };
-
-  struct zmq_action_object {
-    uint64_t                     global_action_seq;
-    block_num_type               block_num;
-    chain::block_timestamp_type  block_time;
-    fc::variant                  action_trace;
-    vector<resource_balance>     resource_balances;
-    vector<currency_balance>     currency_balances;
-    uint32_t                     last_irreversible_block;
-  };
-
-  struct zmq_irreversible_block_object {
-    block_num_type               irreversible_block_num;
-    digest_type                  irreversible_block_digest;
-  };
-
-  struct zmq_fork_block_object {
-    block_num_type                    invalid_block_num;
-  };
-
-  struct zmq_accepted_block_object {
-    block_num_type               accepted_block_num;
-    digest_type                  accepted_block_digest;
-  };
-
-  // see status definitions in libraries/chain/include/eosio/chain/block.hpp
-  struct zmq_failed_transaction_object {
-    string                                         trx_id;
-    block_num_type                                 block_num;
-    eosio::chain::transaction_receipt::status_enum status_name; // enum
-    uint8_t                                        status_int;  // the same as status, but integer
-  };
-}
-
-
 namespace eosio {
   using namespace chain;
   using namespace zmqplugin;
-  using boost::signals2::scoped_connection;
 
   static appbase::abstract_plugin& _zmq_plugin = app().register_plugin<zmq_plugin>();
 
-  class zmq_plugin_impl {
-  public:
-    zmq::context_t context;
-    zmq::socket_t sender_socket;
-    string socket_bind_str;
-    chain_plugin*          chain_plug = nullptr;
-    fc::microseconds       abi_serializer_max_time;
-    std::set<name>         system_accounts;
-    std::map<name,std::set<name>>  blacklist_actions;
-    std::map<transaction_id_type, transaction_trace_ptr> cached_traces;
-    uint32_t _end_block = 0;
-
-    fc::optional<scoped_connection> applied_transaction_connection;
-    fc::optional<scoped_connection> accepted_block_connection;
-    fc::optional<scoped_connection> irreversible_block_connection;
-
-    zmq_plugin_impl():
-      context(1),
-      sender_socket(context, ZMQ_PUSH)
-    {
-      std::vector<name> sys_acc_names = {
-        chain::config::system_account_name,
-        N(eosio.msig),  N(eosio.token),  N(eosio.ram), N(eosio.ramfee),
-        N(eosio.stake), N(eosio.vpay), N(eosio.bpay), N(eosio.saving)
-      };
-
-      for(name n : sys_acc_names) {
-        system_accounts.insert(n);
-      }
 
-      blacklist_actions.emplace
-        (std::make_pair(chain::config::system_account_name,
-                        std::set<name>{ N(onblock) } ));
-      blacklist_actions.emplace
-        (std::make_pair(N(blocktwitter),
-                        std::set<name>{ N(tweet) } ));
-    }
+  zmq_plugin::zmq_plugin():my(new zmq_plugin_impl()){}
+  zmq_plugin::~zmq_plugin(){}
 
+  void zmq_plugin::set_program_options(options_description&, options_description& cfg)
+  {
+    cfg.add_options()
+      (SENDER_BIND, bpo::value<vector<string>>()->composing()
+       ->default_value(vector<string>{SENDER_BIND_DEFAULT}, SENDER_BIND_DEFAULT),
+       "ZMQ Sender Socket binding (may specify multiple times for sharded output)")
+      (SHARD_BY_OPT, bpo::value<string>()->default_value(SHARD_BY_DEFAULT),
+       "Partitioning of action traces between multiple sender sockets: contract, receiver, or accounts")
+      (SENDER_TYPE_OPT, bpo::value<string>()->default_value(SENDER_TYPE_DEFAULT),
+       "Sender socket type: push, pub (XPUB with topic frames), or router (credit-based flow control)")
+      (ROUTER_TIMEOUT_OPT, bpo::value<uint32_t>()->default_value(ROUTER_TIMEOUT_DEFAULT),
+       "In router mode, seconds of silence after which a consumer's unacknowledged messages are redelivered")
+      (ROUTER_MAX_PENDING_OPT, bpo::value<uint32_t>()->default_value(ROUTER_MAX_PENDING_DEFAULT),
+       "In router mode, number of messages per socket waiting for consumer credits")
+      (QUEUE_SIZE_OPT, bpo::value<uint32_t>()->default_value(QUEUE_SIZE_DEFAULT),
+       "Number of messages buffered between the chain thread and the ZMQ sender thread")
+      (OVERFLOW_POLICY_OPT, bpo::value<string>()->default_value(OVERFLOW_POLICY_DEFAULT),
+       "Action when the sender queue is full: block, spill (to memory), or drop (with a gap marker)")
+      (ENCODING_OPT, bpo::value<string>()->default_value(ENCODING_DEFAULT),
+       "Message encoding: json, or binary (fc::raw packed, action data not decoded)")
+      (JSON_WRITER_OPT, bpo::value<string>()->default_value(JSON_WRITER_DEFAULT),
+       "Action trace JSON writer: variant (through fc::variant trees), or streaming (verify with zmq_plugin_bench --verify-json first)")
+      (IRREVERSIBLE_ONLY_OPT, bpo::bool_switch()->default_value(false),
+       "Send the messages of a block only when it becomes irreversible, and never send fork messages")
+      (COLUMNAR_BLOCKS_OPT, bpo::value<uint32_t>()->default_value(0),
+       "Send the action traces of every N blocks in one Arrow IPC message instead of individual messages (0 to disable)")
+      (SCHEMA_REGISTRY_OPT, bpo::bool_switch()->default_value(false),
+       "Send contract ABIs in schema messages, and action data without decoding it")
+      (BATCH_OPT, bpo::bool_switch()->default_value(false),
+       "Send one message per block containing the accepted block, its action traces and failed transactions")
+      (SERIALIZER_THREADS_OPT, bpo::value<uint32_t>()->default_value(0),
+       "Number of additional threads serializing the action traces of a block in parallel (0 to serialize on the chain thread)")
+      (WHITELIST_OPT, bpo::value<vector<string>>()->composing(),
+       "Only send actions matching contract:action:receiver, any part may be * (may specify multiple times)")
+      (BLACKLIST_OPT, bpo::value<vector<string>>()->composing()
+       ->default_value(vector<string>{"eosio:onblock:*", "blocktwitter:tweet:*"},
+                       "eosio:onblock:* blocktwitter:tweet:*"),
+       "Do not send actions matching contract:action:receiver, any part may be * (may specify multiple times)")
+      (SYSTEM_ACCOUNT_OPT, bpo::value<vector<string>>()->composing()
+       ->default_value(vector<string>{"eosio", "eosio.msig", "eosio.token", "eosio.ram", "eosio.ramfee",
+                                      "eosio.stake", "eosio.vpay", "eosio.bpay", "eosio.saving"},
+                       "eosio eosio.msig eosio.token eosio.ram eosio.ramfee eosio.stake eosio.vpay eosio.bpay eosio.saving"),
+       "Account excluded from resource and currency balances (may specify multiple times)")
+      (ACCOUNT_FIELDS_OPT, bpo::value<vector<string>>()->composing(),
+       "Account name fields of an action as contract:action:offset[,offset...], byte offsets in the packed action data, contract may be * (may specify multiple times)")
+      (TOKEN_ACTION_OPT, bpo::value<vector<string>>()->composing(),
+       "Action of a token contract as contract:action, contract may be *, in addition to *:transfer, *:issue and *:open (may specify multiple times)")
+      (CONTROL_BIND_OPT, bpo::value<string>()->default_value(""),
+       "ZMQ REP socket binding for consumer subscription requests (empty to disable)")
+      (JOURNAL_DIR_OPT, bpo::value<bfs::path>()->default_value(""),
+       "Directory for the journal of sent messages, relative to data-dir if not absolute (empty to disable)")
+      (JOURNAL_SEGMENT_MB_OPT, bpo::value<uint32_t>()->default_value(JOURNAL_SEGMENT_MB_DEFAULT),
+       "Size of a journal segment file, in megabytes")
+      (JOURNAL_RETENTION_OPT, bpo::value<uint32_t>()->default_value(JOURNAL_RETENTION_DEFAULT),
+       "Number of irreversible blocks kept in the journal")
+      (JOURNAL_BIND_OPT, bpo::value<string>()->default_value(""),
+       "ZMQ REP socket binding for journal replay requests (empty to disable)")
+      (COMPRESSION_OPT, bpo::value<string>()->default_value(COMPRESSION_DEFAULT),
+       "Message data compression: none, lz4, or zstd")
+      (COMPRESSION_LEVEL_OPT, bpo::value<int>()->default_value(0),
+       "Compression level (0 for the library default; a positive value selects LZ4 HC for lz4)")
+      (ZSTD_DICTIONARY_OPT, bpo::value<bfs::path>()->default_value(""),
+       "Pre-trained zstd dictionary file")
+      (ABI_CACHE_SIZE_OPT, bpo::value<uint32_t>()->default_value(ABI_CACHE_SIZE_DEFAULT),
+       "Number of contract ABI serializers kept in the cache (0 to disable)")
+      (DELTA_CONTRACT_OPT, bpo::value<vector<string>>()->composing(),
+       "Contract whose table row changes are sent (may specify multiple times)")
+      (BALANCE_DELTA_OPT, bpo::bool_switch()->default_value(false),
+       "Include in action traces only the balances that changed since they were last sent")
+      (BALANCE_REFRESH_OPT, bpo::value<uint32_t>()->default_value(BALANCE_REFRESH_DEFAULT),
+       "In balance delta mode, send full balances again every N blocks (0 to disable)")
+      (SNAPSHOT_CONTRACT_OPT, bpo::value<vector<string>>()->composing()
+       ->default_value(vector<string>{"eosio.token"}, "eosio.token"),
+       "Token contract whose balances are included in snapshots (may specify multiple times)")
+      (SNAPSHOT_ON_STARTUP_OPT, bpo::bool_switch()->default_value(false),
+       "Send a snapshot of all resource and currency balances after the first block. Block processing is paused while the snapshot is taken, for several seconds on a large chain")
+      (SNAPSHOT_ON_REQUEST_OPT, bpo::bool_switch()->default_value(false),
+       "Accept snapshot requests on the control socket. Any client of the socket can then pause block processing for several seconds: do not enable on block producers")
+      (SNAPSHOT_CHUNK_OPT, bpo::value<uint32_t>()->default_value(SNAPSHOT_CHUNK_DEFAULT),
+       "Number of accounts per balance snapshot message")
+      (TRACE_CACHE_MB_OPT, bpo::value<uint32_t>()->default_value(TRACE_CACHE_MB_DEFAULT),
+       "Memory limit in megabytes for transaction traces waiting for their block")
+      (RECORD_FIXTURE_OPT, bpo::value<bfs::path>()->default_value(""),
+       "Record blocks, transaction traces and ABIs to this file for zmq_plugin_bench")
+      ;
+  }
 
-    void send_msg( const string content, int32_t msgtype, int32_t msgopts)
-    {
-      zmq::message_t message(content.length()+sizeof(msgtype)+sizeof(msgopts));
-      unsigned char* ptr = (unsigned char*) message.data();
-      memcpy(ptr, &msgtype, sizeof(msgtype));
-      ptr += sizeof(msgtype);
-      memcpy(ptr, &msgopts, sizeof(msgopts));
-      ptr += sizeof(msgopts);
-      memcpy(ptr, content.c_str(), content.length());
-      sender_socket.send(message);
+  bool zmq_plugin_impl::configure(const variables_map& options)
+  {
+    vector<string> bind_strs;
+    for( const auto& b : options.at(SENDER_BIND).as<vector<string>>() ) {
+      if( !b.empty() ) {
+        bind_strs.push_back(b);
+      }
+    }
+    if (bind_strs.empty()) {
+      wlog("zmq-sender-bind not specified => eosio::zmq_plugin disabled.");
+      return false;
     }
 
-
-    void on_applied_transaction( const transaction_trace_ptr& p )
-    {
-      if (p->receipt) {
-        cached_traces[p->id] = p;
-      }
+    const string type = options.at(SENDER_TYPE_OPT).as<string>();
+    if( type == "push" ) {
+      output_opts.type = sender_type::push;
     }
+    else if( type == "pub" ) {
+      output_opts.type = sender_type::pub;
+    }
+    else if( type == "router" ) {
+      output_opts.type = sender_type::router;
+    }
+    else {
+      EOS_ASSERT( false, plugin_config_exception, "Unknown ${o}: ${t}", ("o", SENDER_TYPE_OPT)("t", type) );
+    }
+    pub_mode = (output_opts.type == sender_type::pub);
+    output_opts.router_timeout = fc::seconds(options.at(ROUTER_TIMEOUT_OPT).as<uint32_t>());
+    output_opts.router_max_pending = std::max<uint32_t>(1, options.at(ROUTER_MAX_PENDING_OPT).as<uint32_t>());
 
+    const string shard_by = options.at(SHARD_BY_OPT).as<string>();
+    if( shard_by == "contract" ) {
+      sharding = shard_key::contract;
+    }
+    else if( shard_by == "receiver" ) {
+      sharding = shard_key::receiver;
+    }
+    else if( shard_by == "accounts" ) {
+      sharding = shard_key::accounts;
+    }
+    else {
+      EOS_ASSERT( false, plugin_config_exception, "Unknown ${o}: ${s}", ("o", SHARD_BY_OPT)("s", shard_by) );
+    }
 
-    void on_accepted_block(const block_state_ptr& block_state)
-    {
-      auto block_num = block_state->block->block_num();
-      if ( _end_block >= block_num ) {
-        // report a fork. All traces sent with higher block number are invalid.
-        zmq_fork_block_object zfbo;
-        zfbo.invalid_block_num = block_num;
-        send_msg(fc::json::to_string(zfbo), MSGTYPE_FORK, 0);
-      }
+    queue_size = options.at(QUEUE_SIZE_OPT).as<uint32_t>();
+    EOS_ASSERT( queue_size > 0, plugin_config_exception, "${o} must be positive", ("o", QUEUE_SIZE_OPT) );
 
-      _end_block = block_num;
+    const string overflow = options.at(OVERFLOW_POLICY_OPT).as<string>();
+    if( overflow == "block" ) {
+      policy = overflow_policy::block;
+    }
+    else if( overflow == "spill" ) {
+      policy = overflow_policy::spill;
+    }
+    else if( overflow == "drop" ) {
+      policy = overflow_policy::drop;
+    }
+    else {
+      EOS_ASSERT( false, plugin_config_exception, "Unknown ${o}: ${p}", ("o", OVERFLOW_POLICY_OPT)("p", overflow) );
+    }
 
-      {
-        zmq_accepted_block_object zabo;
-        zabo.accepted_block_num = block_num;
-        zabo.accepted_block_digest = block_state->block->digest();
-        send_msg(fc::json::to_string(zabo), MSGTYPE_ACCEPTED_BLOCK, 0);
+    const string encoding = options.at(ENCODING_OPT).as<string>();
+    EOS_ASSERT( encoding == "json" || encoding == "binary", plugin_config_exception,
+                "Unknown ${o}: ${e}", ("o", ENCODING_OPT)("e", encoding) );
+    binary_encoding = (encoding == "binary");
+    const string json_writer_type = options.at(JSON_WRITER_OPT).as<string>();
+    EOS_ASSERT( json_writer_type == "streaming" || json_writer_type == "variant", plugin_config_exception,
+                "Unknown ${o}: ${w}", ("o", JSON_WRITER_OPT)("w", json_writer_type) );
+    streaming_json = (json_writer_type == "streaming");
+    batch_blocks = options.at(BATCH_OPT).as<bool>();
+    irreversible_only = options.at(IRREVERSIBLE_ONLY_OPT).as<bool>();
+    schema_registry = options.at(SCHEMA_REGISTRY_OPT).as<bool>();
+    abi_serializers.set_capacity(options.at(ABI_CACHE_SIZE_OPT).as<uint32_t>());
+    if( options.count(DELTA_CONTRACT_OPT) ) {
+      for( const auto& c : options.at(DELTA_CONTRACT_OPT).as<vector<string>>() ) {
+        delta_contracts.insert(name(c));
       }
-      
-      for (auto& r : block_state->block->transactions) {
-        transaction_id_type id;
-        if (r.trx.contains<transaction_id_type>()) {
-          id = r.trx.get<transaction_id_type>();
-        }
-        else {
-          id = r.trx.get<packed_transaction>().id();
-        }
-        
-        if( r.status == transaction_receipt_header::executed ) {
-          // Send traces only for executed transactions
-          auto it = cached_traces.find(id);
-          if (it == cached_traces.end() || !it->second->receipt) {
-            ilog("missing trace for transaction {id}", ("id", id));
-            continue;
-          }
-
-          for( const auto& atrace : it->second->action_traces ) {
-            on_action_trace( atrace, block_state );
-          }
-        }
-        else {
-          // Notify about a failed transaction
-          zmq_failed_transaction_object zfto;
-          zfto.trx_id = id.str();
-          zfto.block_num = block_num;
-          zfto.status_name = r.status;
-          zfto.status_int = static_cast<uint8_t>(r.status);
-          send_msg(fc::json::to_string(zfto), MSGTYPE_FAILED_TX, 0);          
-        }
+    }
+    for( const auto& c : options.at(SNAPSHOT_CONTRACT_OPT).as<vector<string>>() ) {
+      snapshot_contracts.emplace_back(c);
+    }
+    snapshot_chunk_size = std::max<uint32_t>(1, options.at(SNAPSHOT_CHUNK_OPT).as<uint32_t>());
+    snapshot_requested = options.at(SNAPSHOT_ON_STARTUP_OPT).as<bool>();
+    snapshot_on_request = options.at(SNAPSHOT_ON_REQUEST_OPT).as<bool>();
+    cached_traces.set_capacity(size_t(options.at(TRACE_CACHE_MB_OPT).as<uint32_t>()) << 20);
+
+    if( options.count(WHITELIST_OPT) ) {
+      for( const auto& rule : options.at(WHITELIST_OPT).as<vector<string>>() ) {
+        whitelist.add_rule(rule);
       }
-
-      cached_traces.clear();
     }
-
-
-    void on_action_trace( const action_trace& at, const block_state_ptr& block_state )
-    {
-      // check the action against the blacklist
-      auto search_acc = blacklist_actions.find(at.act.account);
-      if(search_acc != blacklist_actions.end()) {
-        auto search_act = search_acc->second.find(at.act.name);
-        if( search_act != search_acc->second.end() ) {
-          return;
-        }
+    if( options.count(BLACKLIST_OPT) ) {
+      for( const auto& rule : options.at(BLACKLIST_OPT).as<vector<string>>() ) {
+        blacklist.add_rule(rule);
       }
+    }
+    if( options.count(SYSTEM_ACCOUNT_OPT) ) {
+      for( const auto& acc : options.at(SYSTEM_ACCOUNT_OPT).as<vector<string>>() ) {
+        system_accounts.insert(name(acc).value);
+      }
+    }
+    if( options.count(ACCOUNT_FIELDS_OPT) ) {
+      for( const auto& rule : options.at(ACCOUNT_FIELDS_OPT).as<vector<string>>() ) {
+        extractor.add_fields_rule(rule);
+      }
+    }
+    if( options.count(TOKEN_ACTION_OPT) ) {
+      for( const auto& rule : options.at(TOKEN_ACTION_OPT).as<vector<string>>() ) {
+        extractor.add_token_rule(rule);
+      }
+    }
 
-      auto& chain = chain_plug->chain();
-
-      zmq_action_object zao;
-      zao.global_action_seq = at.receipt.global_sequence;
-      zao.block_num = block_state->block->block_num();
-      zao.block_time = block_state->block->timestamp;
-      zao.action_trace = chain.to_variant_with_abi(at, abi_serializer_max_time);
+    uint32_t serializer_threads = options.at(SERIALIZER_THREADS_OPT).as<uint32_t>();
+    if( serializer_threads > 0 ) {
+      serializers.reset(new worker_pool(serializer_threads));
+    }
 
-      std::set<name> accounts;
-      std::set<name> token_contracts;
+    for( const auto& b : bind_strs ) {
+      ilog("Binding to ZMQ ${t} socket ${u}", ("t", type)("u", b));
+      outputs.emplace_back(new sender_output(context, b, output_opts));
+    }
 
-      find_accounts_and_tokens(at, accounts, token_contracts);
+    balance_deltas = options.at(BALANCE_DELTA_OPT).as<bool>();
+    // the last-sent balances are kept per output, which is only correct if
+    // every message of the output reaches the same consumer
+    EOS_ASSERT( !balance_deltas || output_opts.type == sender_type::push, plugin_config_exception,
+                "${d} requires ${t} = push", ("d", BALANCE_DELTA_OPT)("t", SENDER_TYPE_OPT) );
+    balance_refresh_blocks = options.at(BALANCE_REFRESH_OPT).as<uint32_t>();
+    sent_balances_by_output.resize(outputs.size());
+
+    columnar_blocks = options.at(COLUMNAR_BLOCKS_OPT).as<uint32_t>();
+    if( columnar_blocks > 0 ) {
+#ifndef ZMQ_PLUGIN_HAVE_ARROW
+      EOS_ASSERT( false, plugin_config_exception, "zmq_plugin is compiled without Arrow support" );
+#endif
+      EOS_ASSERT( !batch_blocks, plugin_config_exception,
+                  "${c} cannot be combined with ${b}", ("c", COLUMNAR_BLOCKS_OPT)("b", BATCH_OPT) );
+      columnar_batches.resize(outputs.size());
+    }
 
-      for (auto it = accounts.begin(); it != accounts.end(); ++it) {
-        name account_name = *it;
-        if( is_account_of_interest(account_name) ) {
-          add_account_resource( zao, account_name );
-          for (auto it2 = token_contracts.begin(); it2 != token_contracts.end(); ++it2) {
-            add_currency_balances( zao, account_name, *it2 );
-          }
-        }
+    const string compression = options.at(COMPRESSION_OPT).as<string>();
+    if( compression != "none" ) {
+      EOS_ASSERT( compression == "lz4" || compression == "zstd", plugin_config_exception,
+                  "Unknown ${o}: ${c}", ("o", COMPRESSION_OPT)("c", compression) );
+      string dictionary;
+      const auto dict_file = options.at(ZSTD_DICTIONARY_OPT).as<bfs::path>();
+      if( !dict_file.empty() ) {
+        std::ifstream in(dict_file.string(), std::ios::binary);
+        EOS_ASSERT( in.good(), plugin_config_exception, "Cannot read ${f}", ("f", dict_file.string()) );
+        dictionary.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
       }
+      compressor.reset(new message_compressor(compression == "lz4" ?
+                                              message_compressor::algorithm::lz4 :
+                                              message_compressor::algorithm::zstd,
+                                              options.at(COMPRESSION_LEVEL_OPT).as<int>(),
+                                              dictionary));
+    }
 
-      zao.last_irreversible_block = chain.last_irreversible_block_num();
-      send_msg(fc::json::to_string(zao), MSGTYPE_ACTION_TRACE, 0);
+    auto journal_dir = options.at(JOURNAL_DIR_OPT).as<bfs::path>();
+    if( !journal_dir.empty() ) {
+      if( journal_dir.is_relative() ) {
+        journal_dir = app().data_dir() / journal_dir;
+      }
+      journal.reset(new message_journal());
+      journal->open(journal_dir, uint64_t(options.at(JOURNAL_SEGMENT_MB_OPT).as<uint32_t>()) * 1024 * 1024);
+      journal_retention = options.at(JOURNAL_RETENTION_OPT).as<uint32_t>();
     }
 
+    control_bind_str = options.at(CONTROL_BIND_OPT).as<string>();
+    if( !control_bind_str.empty() ) {
+      ilog("Binding to ZMQ control socket ${u}", ("u", control_bind_str));
+      control_socket.reset(new zmq::socket_t(context, ZMQ_REP));
+      control_socket->bind(control_bind_str);
+    }
 
-    void on_irreversible_block( const chain::block_state_ptr& bs )
-    {
-      zmq_irreversible_block_object zibo;
-      zibo.irreversible_block_num = bs->block->block_num();
-      zibo.irreversible_block_digest = bs->block->digest();
-      send_msg(fc::json::to_string(zibo), MSGTYPE_IRREVERSIBLE_BLOCK, 0);
+    journal_bind_str = options.at(JOURNAL_BIND_OPT).as<string>();
+    if( !journal_bind_str.empty() ) {
+      EOS_ASSERT( journal, plugin_config_exception, "${b} requires ${d}", ("b", JOURNAL_BIND_OPT)("d", JOURNAL_DIR_OPT) );
+      ilog("Binding to ZMQ journal socket ${u}", ("u", journal_bind_str));
+      journal_socket.reset(new zmq::socket_t(context, ZMQ_REP));
+      journal_socket->bind(journal_bind_str);
     }
 
+    queue.reset(new spsc_ring<zmq_outgoing_message>(queue_size));
+    sender_thread = std::thread([this]{ sender_loop(); });
 
-    void find_accounts_and_tokens(const action_trace& at,
-                                  std::set<name>& accounts,
-                                  std::set<name>& token_contracts)
-    {
-      accounts.insert(at.act.account);
+    if( control_socket || journal_socket ) {
+      control_thread = std::thread([this]{ control_loop(); });
+    }
+    return true;
+  }
 
-      if( at.receipt.receiver != at.act.account ) {
-        accounts.insert(at.receipt.receiver);
+  void zmq_plugin_impl::shutdown()
+  {
+    if( ! outputs.empty() ) {
+      // the rows of an incomplete columnar batch are sent before the
+      // sender thread drains the queue and stops
+      if( columnar_blocks > 0 ) {
+        send_columnar_batches();
       }
-
-      if( at.act.account == config::system_account_name ) {
-        switch((uint64_t) at.act.name) {
-        case N(newaccount):
-          {
-            const auto data = at.act.data_as<chain::newaccount>();
-            accounts.insert(data.name);
-          }
-          break;
-        case N(setcode):
-          {
-            const auto data = at.act.data_as<chain::setcode>();
-            accounts.insert(data.account);
-          }
-          break;
-        case N(setabi):
-          {
-            const auto data = at.act.data_as<chain::setabi>();
-            accounts.insert(data.account);
-          }
-          break;
-        case N(updateauth):
-          {
-            const auto data = at.act.data_as<chain::updateauth>();
-            accounts.insert(data.account);
-          }
-          break;
-        case N(deleteauth):
-          {
-            const auto data = at.act.data_as<chain::deleteauth>();
-            accounts.insert(data.account);
-          }
-          break;
-        case N(linkauth):
-          {
-            const auto data = at.act.data_as<chain::linkauth>();
-            accounts.insert(data.account);
-          }
-          break;
-        case N(unlinkauth):
-          {
-            const auto data = at.act.data_as<chain::unlinkauth>();
-            accounts.insert(data.account);
-          }
-          break;
-        case N(buyrambytes):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::buyrambytes>();
-            accounts.insert(data.payer);
-            if( data.receiver != data.payer ) {
-              accounts.insert(data.receiver);
-            }
-          }
-          break;
-        case N(buyram):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::buyram>();
-            accounts.insert(data.payer);
-            if( data.receiver != data.payer ) {
-              accounts.insert(data.receiver);
-            }
-          }
-          break;
-        case N(sellram):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::sellram>();
-            accounts.insert(data.account);
-          }
-          break;
-        case N(delegatebw):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::delegatebw>();
-            accounts.insert(data.from);
-            if( data.receiver != data.from ) {
-              accounts.insert(data.receiver);
-            }
-          }
-          break;
-        case N(undelegatebw):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::undelegatebw>();
-            accounts.insert(data.from);
-            if( data.receiver != data.from ) {
-              accounts.insert(data.receiver);
-            }
-          }
-          break;
-        case N(refund):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::refund>();
-            accounts.insert(data.owner);
-          }
-          break;
-        case N(regproducer):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::regproducer>();
-            accounts.insert(data.producer);
-          }
-          break;
-        case N(bidname):
-          {
-            // do nothing because newname account does not exist yet
-          }
-          break;
-        case N(unregprod):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::unregprod>();
-            accounts.insert(data.producer);
-          }
-          break;
-        case N(regproxy):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::regproxy>();
-            accounts.insert(data.proxy);
-          }
-          break;
-        case N(voteproducer):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::voteproducer>();
-            accounts.insert(data.voter);
-            if( data.proxy ) {
-              accounts.insert(data.proxy);
-            }
-            // not including the producrs list, although some projects may need it
-          }
-          break;
-        case N(claimrewards):
-          {
-            const auto data = at.act.data_as<zmqplugin::syscontract::claimrewards>();
-            accounts.insert(data.owner);
-          }
-          break;
-        }
+      done = true;
+      {
+        std::lock_guard<std::mutex> lock(wait_mtx);
+        wait_cv.notify_all();
       }
-      else if( at.act.name == N(transfer) || at.act.name == N(issue) || at.act.name == N(open) ) {
-        token_contracts.insert(at.act.account);
+      if( sender_thread.joinable() ) {
+        sender_thread.join();
       }
-
-      for( const auto& iline : at.inline_traces ) {
-        find_accounts_and_tokens( iline, accounts, token_contracts );
+      if( control_thread.joinable() ) {
+        control_thread.join();
       }
-    }
-
-    bool is_account_of_interest(name account_name)
-    {
-      auto search = system_accounts.find(account_name);
-      if(search != system_accounts.end()) {
-        return false;
+      if( control_socket ) {
+        control_socket->close();
       }
-      return true;
-    }
-
-    void add_account_resource( zmq_action_object& zao, name account_name )
-    {
-      resource_balance bal;
-      bal.account_name = account_name;
-
-      auto& chain = chain_plug->chain();
-      const auto& rm = chain.get_resource_limits_manager();
-
-      rm.get_account_limits( account_name, bal.ram_quota, bal.net_weight, bal.cpu_weight );
-      bool grelisted = chain.is_resource_greylisted(account_name);
-      bal.net_limit = rm.get_account_net_limit_ex( account_name, !grelisted);
-      bal.cpu_limit = rm.get_account_cpu_limit_ex( account_name, !grelisted);
-      bal.ram_usage = rm.get_account_ram_usage( account_name );
-      zao.resource_balances.emplace_back(bal);
-    }
-
-    void add_currency_balances( zmq_action_object& zao,
-                                name account_name, name token_code )
-    {
-      const auto& chain = chain_plug->chain();
-      const auto& db = chain.db();
-
-      const auto* t_id = db.find<chain::table_id_object, chain::by_code_scope_table>
-        (boost::make_tuple( token_code, account_name, N(accounts) ));
-      if( t_id != nullptr ) {
-          const auto &idx = db.get_index<key_value_index, by_scope_primary>();
-          decltype(t_id->id) next_tid(t_id->id._id + 1);
-          auto lower = idx.lower_bound(boost::make_tuple(t_id->id));
-          auto upper = idx.lower_bound(boost::make_tuple(next_tid));
-
-          for (auto obj = lower; obj != upper; ++obj) {
-            if( obj->value.size() >= sizeof(asset) ) {
-              asset bal;
-              fc::datastream<const char *> ds(obj->value.data(), obj->value.size());
-              fc::raw::unpack(ds, bal);
-              if( bal.get_symbol().valid() ) {
-                zao.currency_balances.emplace_back(currency_balance{account_name, token_code, bal});
-              }
-            }
-          }
+      if( journal_socket ) {
+        journal_socket->close();
+      }
+      if( journal ) {
+        journal->flush();
       }
+      for( auto& out : outputs ) {
+        out->close();
+      }
+      ilog("ZMQ trace cache: ${h} hits, ${m} misses, ${e} evictions",
+           ("h", cached_traces.hits)("m", cached_traces.misses)("e", cached_traces.evictions));
     }
-  };
-
-
-  zmq_plugin::zmq_plugin():my(new zmq_plugin_impl()){}
-  zmq_plugin::~zmq_plugin(){}
-
-  void zmq_plugin::set_program_options(options_description&, options_description& cfg)
-  {
-    cfg.add_options()
-      (SENDER_BIND, bpo::value<string>()->default_value(SENDER_BIND_DEFAULT),
-       "ZMQ Sender Socket binding")
-      ;
   }
 
   void zmq_plugin::plugin_initialize(const variables_map& options)
   {
-    my->socket_bind_str = options.at(SENDER_BIND).as<string>();
-    if (my->socket_bind_str.empty()) {
-      wlog("zmq-sender-bind not specified => eosio::zmq_plugin disabled.");
+    if( !my->configure(options) ) {
       return;
     }
 
-    ilog("Binding to ZMQ PUSH socket ${u}", ("u", my->socket_bind_str));
-    my->sender_socket.bind(my->socket_bind_str);
-
     my->chain_plug = app().find_plugin<chain_plugin>();
     my->abi_serializer_max_time = my->chain_plug->get_abi_serializer_max_time();
 
     auto& chain = my->chain_plug->chain();
+    my->state.reset(new controller_state(chain));
+
+    auto fixture = options.at(RECORD_FIXTURE_OPT).as<bfs::path>();
+    if( !fixture.empty() ) {
+      if( fixture.is_relative() ) {
+        fixture = app().data_dir() / fixture;
+      }
+      ilog("Recording ZMQ plugin benchmark fixture to ${f}", ("f", fixture.generic_string()));
+      my->recorder.reset(new fixture_recorder(fixture));
+    }
 
     my->applied_transaction_connection.emplace
       ( chain.applied_transaction.connect( [&]( const transaction_trace_ptr& p ){
@@ -577,74 +412,47 @@ namespace eosio {
       ( chain.accepted_block.connect([&](const block_state_ptr& p) {
           my->on_accepted_block(p); }));
 
+    my->load_reversible_blocks(app().data_dir() / REVERSIBLE_BLOCKS_FILE);
+
     my->irreversible_block_connection.emplace
       ( chain.irreversible_block.connect( [&]( const chain::block_state_ptr& bs ) {
           my->on_irreversible_block( bs ); } ));
   }
 
   void zmq_plugin::plugin_startup() {
+    // the metrics are served if the HTTP API is enabled
+    auto* http = app().find_plugin<http_plugin>();
+    if( http == nullptr || http->get_state() == abstract_plugin::registered ) {
+      return;
+    }
 
+    http->add_api({
+        { std::string("/v1/zmq/get_metrics"),
+          [this](string, string body, url_response_callback cb) {
+            try {
+              cb(200, fc::json::to_string(my->metrics.to_variant(my->queue ? my->queue->size() : 0)));
+            }
+            catch( ... ) {
+              http_plugin::handle_exception("zmq", "get_metrics", body, cb);
+            }
+          } },
+        { std::string("/v1/zmq/metrics"),
+          [this](string, string body, url_response_callback cb) {
+            try {
+              cb(200, my->metrics.to_prometheus(my->queue ? my->queue->size() : 0));
+            }
+            catch( ... ) {
+              http_plugin::handle_exception("zmq", "metrics", body, cb);
+            }
+          } }
+      });
+    ilog("ZMQ plugin metrics are available at /v1/zmq/get_metrics and /v1/zmq/metrics");
   }
 
   void zmq_plugin::plugin_shutdown() {
-    if( ! my->socket_bind_str.empty() ) {
-      my->sender_socket.disconnect(my->socket_bind_str);
-      my->sender_socket.close();
+    if( !my->outputs.empty() ) {
+      my->save_reversible_blocks(app().data_dir() / REVERSIBLE_BLOCKS_FILE);
     }
+    my->shutdown();
   }
 }
-
-FC_REFLECT( zmqplugin::syscontract::buyrambytes,
-            (payer)(receiver)(bytes) )
-
-FC_REFLECT( zmqplugin::syscontract::buyram,
-            (payer)(receiver)(quant) )
-
-FC_REFLECT( zmqplugin::syscontract::sellram,
-            (account)(bytes) )
-
-FC_REFLECT( zmqplugin::syscontract::delegatebw,
-            (from)(receiver)(stake_net_quantity)(stake_cpu_quantity)(transfer) )
-
-FC_REFLECT( zmqplugin::syscontract::undelegatebw,
-            (from)(receiver)(unstake_net_quantity)(unstake_cpu_quantity) )
-
-FC_REFLECT( zmqplugin::syscontract::refund,
-            (owner) )
-
-FC_REFLECT( zmqplugin::syscontract::regproducer,
-            (producer)(producer_key)(url)(location) )
-
-FC_REFLECT( zmqplugin::syscontract::unregprod,
-            (producer) )
-
-FC_REFLECT( zmqplugin::syscontract::regproxy,
-            (proxy)(isproxy) )
-
-FC_REFLECT( zmqplugin::syscontract::voteproducer,
-            (voter)(proxy)(producers) )
-
-FC_REFLECT( zmqplugin::syscontract::claimrewards,
-            (owner) )
-
-FC_REFLECT( zmqplugin::resource_balance,
-            (account_name)(ram_quota)(ram_usage)(net_weight)(cpu_weight)(net_limit)(cpu_limit) )
-
-FC_REFLECT( zmqplugin::currency_balance,
-            (account_name)(contract)(balance))
-
-FC_REFLECT( zmqplugin::zmq_action_object,
-            (global_action_seq)(block_num)(block_time)(action_trace)
-            (resource_balances)(currency_balances)(last_irreversible_block) )
-
-FC_REFLECT( zmqplugin::zmq_irreversible_block_object,
-            (irreversible_block_num)(irreversible_block_digest) )
-
-FC_REFLECT( zmqplugin::zmq_fork_block_object,
-            (invalid_block_num) )
-
-FC_REFLECT( zmqplugin::zmq_accepted_block_object,
-            (accepted_block_num)(accepted_block_digest) )
-
-FC_REFLECT( zmqplugin::zmq_failed_transaction_object,
-            (trx_id)(block_num)(status_name)(status_int) )
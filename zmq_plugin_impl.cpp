@@ -0,0 +1,1361 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *  @author cc32d9 <cc32d9@gmail.com>
+ *
+ *  The message pipeline of zmq_plugin_impl, compiled once into the plugin
+ *  library and linked by the offline benchmark.
+ */
+#include "zmq_plugin_impl.hpp"
+
+namespace eosio {
+  using namespace chain;
+  using namespace zmqplugin;
+
+  zmq_plugin_impl::zmq_plugin_impl():
+    context(1)
+  {
+  }
+
+
+  buffer_ptr zmq_plugin_impl::new_message()
+  {
+    return buffers.acquire();
+  }
+
+
+  void zmq_plugin_impl::write_header(zmq_outgoing_message& msg)
+  {
+    memcpy(&msg.content->data[0], &msg.msgtype, sizeof(msg.msgtype));
+    memcpy(&msg.content->data[sizeof(msg.msgtype)], &msg.msgopts, sizeof(msg.msgopts));
+  }
+
+
+  void zmq_plugin_impl::send_msg( buffer_ptr content, int32_t msgtype, int32_t msgopts,
+                                  uint64_t global_action_seq, int32_t shard )
+  {
+    enqueue(zmq_outgoing_message{msgtype, msgopts, std::move(content), _end_block, global_action_seq, shard});
+  }
+
+
+  void zmq_plugin_impl::enqueue( zmq_outgoing_message&& msg )
+  {
+    if( current_block != nullptr ) {
+      current_block->messages.emplace_back(std::move(msg));
+      return;
+    }
+
+    if( dropped_messages > 0 && queue->size() < queue_size ) {
+      zmq_gap_object zgo;
+      zgo.dropped_messages = dropped_messages;
+      zgo.first_block_num = dropped_first_block;
+      zgo.last_block_num = _end_block;
+      zmq_outgoing_message gap{MSGTYPE_GAP, encoding_opts(), new_message(), _end_block};
+      encode(zgo, gap.content->data);
+      write_header(gap);
+      if( queue->try_push(gap) ) {
+        wlog("ZMQ sender queue overflow: dropped ${n} messages in blocks ${f}-${l}",
+             ("n", zgo.dropped_messages)("f", zgo.first_block_num)("l", zgo.last_block_num));
+        dropped_messages = 0;
+        notify_sender();
+      }
+    }
+
+    write_header(msg);
+
+    if( spilled_size.load() > 0 ) {
+      // keep the order: nothing goes into the ring while older messages are spilled
+      spill(msg);
+      return;
+    }
+
+    while( !queue->try_push(msg) ) {
+      switch( policy ) {
+      case overflow_policy::block:
+        {
+          const auto start = fc::time_point::now();
+          std::unique_lock<std::mutex> lock(wait_mtx);
+          producer_waiting = true;
+          wait_cv.wait_for(lock, std::chrono::milliseconds(10),
+                           [&]{ return queue->size() < queue_size; });
+          producer_waiting = false;
+          metrics.enqueue_wait.add(fc::time_point::now() - start);
+        }
+        break;
+      case overflow_policy::spill:
+        spill(msg);
+        return;
+      case overflow_policy::drop:
+        ++metrics.dropped_messages;
+        forget_sent_state();
+        if( dropped_messages++ == 0 ) {
+          dropped_first_block = _end_block;
+        }
+        return;
+      }
+    }
+    notify_sender();
+  }
+
+
+  int32_t zmq_plugin_impl::encoding_opts() const
+  {
+    return binary_encoding ? MSGOPT_BINARY : 0;
+  }
+
+
+  int32_t zmq_plugin_impl::action_opts() const
+  {
+    return encoding_opts() | (balance_deltas ? MSGOPT_BALANCE_DELTA : 0);
+  }
+
+
+  void zmq_plugin_impl::reset_sent_balances()
+  {
+    for( auto& sent : sent_balances_by_output ) {
+      sent.clear();
+    }
+  }
+
+
+  void zmq_plugin_impl::forget_sent_state()
+  {
+    reset_sent_balances();
+    sent_schemas.clear();
+  }
+
+
+  template<typename T>
+  void zmq_plugin_impl::encode(const T& obj, string& out) const
+  {
+    if( !binary_encoding ) {
+      out.append(fc::json::to_string(obj));
+      return;
+    }
+    const size_t pos = out.size();
+    out.resize(pos + fc::raw::pack_size(obj));
+    fc::datastream<char*> ds(&out[pos], out.size() - pos);
+    fc::raw::pack(ds, obj);
+  }
+
+
+  template<typename Stream>
+  void zmq_plugin_impl::pack_action_object(Stream& ds, const zmq_action_object& zao, const action_trace& at)
+  {
+    fc::raw::pack(ds, zao.global_action_seq);
+    fc::raw::pack(ds, zao.block_num);
+    fc::raw::pack(ds, zao.block_time);
+    fc::raw::pack(ds, at);
+    fc::raw::pack(ds, zao.resource_balances);
+    fc::raw::pack(ds, zao.currency_balances);
+    fc::raw::pack(ds, zao.last_irreversible_block);
+    if( zao.schemas ) {
+      fc::raw::pack(ds, *zao.schemas);
+    }
+  }
+
+
+  void zmq_plugin_impl::encode_action(const zmq_action_object& zao, const action_trace& at, string& out) const
+  {
+    if( !binary_encoding ) {
+      out.append(fc::json::to_string(zao));
+      return;
+    }
+    fc::datastream<size_t> ps;
+    pack_action_object(ps, zao, at);
+    const size_t pos = out.size();
+    out.resize(pos + ps.tellp());
+    fc::datastream<char*> ds(&out[pos], out.size() - pos);
+    pack_action_object(ds, zao, at);
+  }
+
+
+  void zmq_plugin_impl::encode_batch(const string& accepted, const vector<string>& action_traces,
+                                     const vector<string>& failed_transactions, string& out) const
+  {
+    if( binary_encoding ) {
+      fc::datastream<size_t> ps;
+      fc::raw::pack(ps, action_traces);
+      fc::raw::pack(ps, failed_transactions);
+      out.append(accepted);
+      const size_t pos = out.size();
+      out.resize(pos + ps.tellp());
+      fc::datastream<char*> ds(&out[pos], out.size() - pos);
+      fc::raw::pack(ds, action_traces);
+      fc::raw::pack(ds, failed_transactions);
+      return;
+    }
+
+    size_t size = out.size() + accepted.size() + 64;
+    for( const auto& c : action_traces ) size += c.size() + 1;
+    for( const auto& c : failed_transactions ) size += c.size() + 1;
+
+    out.reserve(size);
+    out.append("{\"accepted_block\":").append(accepted);
+    out.append(",\"action_traces\":[");
+    for( size_t i = 0; i < action_traces.size(); ++i ) {
+      if( i > 0 ) out.push_back(',');
+      out.append(action_traces[i]);
+    }
+    out.append("],\"failed_transactions\":[");
+    for( size_t i = 0; i < failed_transactions.size(); ++i ) {
+      if( i > 0 ) out.push_back(',');
+      out.append(failed_transactions[i]);
+    }
+    out.append("]}");
+  }
+
+
+  void zmq_plugin_impl::spill(zmq_outgoing_message& msg)
+  {
+    std::lock_guard<std::mutex> lock(spill_mtx);
+    if( spilled.empty() ) {
+      wlog("ZMQ sender queue is full, spilling messages to memory");
+    }
+    spilled.emplace_back(std::move(msg));
+    spilled_size = spilled.size();
+    ++metrics.spilled_messages;
+    notify_sender();
+  }
+
+
+  void zmq_plugin_impl::notify_sender()
+  {
+    if( sender_idle.load() ) {
+      std::lock_guard<std::mutex> lock(wait_mtx);
+      wait_cv.notify_all();
+    }
+  }
+
+
+  void zmq_plugin_impl::poll_outputs()
+  {
+    for( auto& out : outputs ) {
+      out->poll_incoming();
+    }
+  }
+
+
+  void zmq_plugin_impl::sender_loop()
+  {
+    zmq_outgoing_message msg;
+    std::deque<zmq_outgoing_message> batch;
+    uint32_t sent = 0;
+    size_t unsent = 0;   // taken from the queue, but not sent
+    while( true ) {
+      if( (++sent & 0xff) == 0 ) {
+        poll_outputs();
+      }
+
+      if( queue->try_pop(msg) ) {
+        if( producer_waiting.load() ) {
+          std::lock_guard<std::mutex> lock(wait_mtx);
+          wait_cv.notify_all();
+        }
+        if( !transmit(msg) ) {
+          unsent = 1;
+          break;
+        }
+        continue;
+      }
+
+      if( spilled_size.load() > 0 ) {
+        {
+          std::lock_guard<std::mutex> lock(spill_mtx);
+          batch.swap(spilled);
+          spilled_size = 0;
+        }
+        size_t transmitted = 0;
+        while( transmitted < batch.size() && transmit(batch[transmitted]) ) {
+          ++transmitted;
+        }
+        unsent = batch.size() - transmitted;
+        batch.clear();
+        if( unsent > 0 ) {
+          break;
+        }
+        continue;
+      }
+
+      if( done.load() ) {
+        break;
+      }
+
+      poll_outputs();
+      std::unique_lock<std::mutex> lock(wait_mtx);
+      sender_idle = true;
+      wait_cv.wait_for(lock, std::chrono::milliseconds(100),
+                       [&]{ return queue->size() > 0 || spilled_size.load() > 0 || done.load(); });
+      sender_idle = false;
+    }
+
+    unsent += queue->size() + spilled_size.load();
+    if( unsent > 0 ) {
+      wlog("ZMQ plugin shutting down with ${n} unsent messages", ("n", unsent));
+    }
+  }
+
+
+  bool zmq_plugin_impl::transmit(zmq_outgoing_message& msg)
+  {
+    if( compressor ) {
+      const auto start = fc::time_point::now();
+      auto compressed = new_message();
+      int32_t flag = compressor->compress(msg.content->data, compressed->data);
+      if( flag != 0 ) {
+        msg.content = std::move(compressed);
+        msg.msgopts |= flag;
+        write_header(msg);
+      }
+      metrics.compress.add(fc::time_point::now() - start);
+    }
+    metrics.count_sent(msg.msgtype, msg.content->data.size());
+
+    if( journal ) {
+      journal->append(msg.block_num, msg.global_action_seq, msg.shard,
+                      msg.content->data.data(), msg.content->data.size());
+      trim_journal();
+    }
+
+    if( pub_mode && msg.topic.empty() ) {
+      msg.topic = default_topic(msg.msgtype);
+    }
+
+    pooled_buffer* buf = msg.content.release();
+    zmq::message_t message(&buf->data[0], buf->data.size(), &buffer_pool::zmq_free, buf);
+
+    const auto start = fc::time_point::now();
+    bool sent = true;
+    if( msg.shard >= 0 ) {
+      sent = outputs[msg.shard]->send(message, msg.topic, done);
+    }
+    else {
+      // broadcast copies share the same buffer
+      for( auto& out : outputs ) {
+        zmq::message_t copy;
+        copy.copy(&message);
+        if( !out->send(copy, msg.topic, done) ) {
+          sent = false;
+          break;
+        }
+      }
+    }
+    metrics.socket_send.add(fc::time_point::now() - start);
+    return sent;
+  }
+
+
+  void zmq_plugin_impl::on_applied_transaction( const transaction_trace_ptr& p )
+  {
+    if (p->receipt) {
+      // the transaction is applied in the pending block
+      cached_traces.insert(p, state->head_block_num() + 1);
+      if( recorder ) {
+        recorder->record_trace(*p);
+      }
+    }
+  }
+
+
+  void zmq_plugin_impl::on_accepted_block(const block_state_ptr& block_state)
+  {
+    const auto start = fc::time_point::now();
+    if( recorder ) {
+      recorder->record_block(*block_state->block);
+    }
+    auto block_num = block_state->block->block_num();
+    auto reset_current_block = fc::make_scoped_exit([this]{ current_block = nullptr; });
+    if( schemas_reset_requested.exchange(false) || _end_block >= block_num ) {
+      // schemas sent in the abandoned branch are sent again
+      sent_schemas.clear();
+    }
+    if( balance_refresh_requested.exchange(false) || _end_block >= block_num ||
+        (balance_refresh_blocks > 0 && block_num % balance_refresh_blocks == 0) ) {
+      // the next action traces contain full balances
+      reset_sent_balances();
+    }
+    for( auto& batch : columnar_batches ) {
+      // actions of the abandoned branch which are not sent yet
+      batch.erase_from(block_num);
+    }
+    if( irreversible_only ) {
+      // blocks of the abandoned branch are never sent
+      const auto abandoned = reversible_blocks.lower_bound(block_num);
+      for( auto it = abandoned; it != reversible_blocks.end(); ++it ) {
+        if( it->second.snapshot ) {
+          snapshot_requested = true;
+        }
+      }
+      reversible_blocks.erase(abandoned, reversible_blocks.end());
+      auto& rb = reversible_blocks[block_num];
+      rb.digest = block_state->block->digest();
+      current_block = &rb;
+    }
+    else if ( _end_block >= block_num ) {
+      // report a fork. All traces sent with higher block number are invalid.
+      zmq_fork_block_object zfbo;
+      zfbo.invalid_block_num = block_num;
+      auto msg = new_message();
+      encode(zfbo, msg->data);
+      send_msg(std::move(msg), MSGTYPE_FORK, encoding_opts());
+    }
+
+    _end_block = block_num;
+    block_subscriptions = std::atomic_load(&subscriptions);
+
+    string accepted;
+    {
+      zmq_accepted_block_object zabo;
+      zabo.accepted_block_num = block_num;
+      zabo.accepted_block_digest = block_state->block->digest();
+      if( batch_blocks ) {
+        encode(zabo, accepted);
+      }
+      else {
+        auto msg = new_message();
+        encode(zabo, msg->data);
+        send_msg(std::move(msg), MSGTYPE_ACCEPTED_BLOCK, encoding_opts());
+      }
+    }
+
+    // Everything that needs the chain state is collected here on the
+    // chain thread. The action traces are serialized afterwards, possibly
+    // in parallel, and sent in the original order.
+    vector<block_item> items;
+    fc::microseconds prepare_time;
+
+    for (auto& r : block_state->block->transactions) {
+      transaction_id_type id;
+      if (r.trx.contains<transaction_id_type>()) {
+        id = r.trx.get<transaction_id_type>();
+      }
+      else {
+        id = r.trx.get<packed_transaction>().id();
+      }
+      
+      if( r.status == transaction_receipt_header::executed ) {
+        // Send traces only for executed transactions
+        auto trace = cached_traces.find(id);
+        if( !trace ) {
+          ilog("missing trace for transaction ${id}", ("id", id));
+          continue;
+        }
+
+        const auto prepare_start = fc::time_point::now();
+        for( const auto& atrace : trace->action_traces ) {
+          block_item item;
+          if( prepare_action( atrace, block_state, item ) ) {
+            if( !batch_blocks && columnar_blocks == 0 ) {
+              item.msg = new_message();
+            }
+            items.emplace_back(std::move(item));
+          }
+        }
+        prepare_time += fc::time_point::now() - prepare_start;
+      }
+      else if( (!block_subscriptions || block_subscriptions->wants_msgtype(MSGTYPE_FAILED_TX)) &&
+               topic_wanted(default_topic(batch_blocks ? MSGTYPE_BLOCK_BATCH : MSGTYPE_FAILED_TX), -1) ) {
+        // Notify about a failed transaction
+        zmq_failed_transaction_object zfto;
+        zfto.trx_id = id.str();
+        zfto.block_num = block_num;
+        zfto.status_name = r.status;
+        zfto.status_int = static_cast<uint8_t>(r.status);
+        block_item item;
+        item.msgtype = MSGTYPE_FAILED_TX;
+        if( !batch_blocks ) {
+          item.msg = new_message();
+        }
+        encode(zfto, item.output());
+        items.emplace_back(std::move(item));
+      }
+    }
+
+    metrics.prepare_actions.add(prepare_time);
+    if( columnar_blocks > 0 ) {
+      // action traces go to the columnar batches, failed transactions
+      // are sent as usual. In irreversible-only mode, the rows wait with
+      // the other messages of the block.
+      auto& batches = (current_block != nullptr) ? current_block->columnar : columnar_batches;
+      batches.resize(outputs.size());
+      for( const auto& item : items ) {
+        if( item.trace != nullptr ) {
+          batches[std::max(item.shard, 0)].add(item.zao, *item.trace);
+        }
+      }
+      items.erase(std::remove_if(items.begin(), items.end(),
+                                 [](const block_item& item) { return item.trace != nullptr; }),
+                  items.end());
+      if( current_block == nullptr && ++columnar_pending_blocks >= columnar_blocks ) {
+        send_columnar_batches();
+      }
+    }
+    {
+      const auto serialize_start = fc::time_point::now();
+      serialize_actions(items);
+      metrics.serialize_actions.add(fc::time_point::now() - serialize_start);
+
+      std::unordered_map<uint64_t, plugin_metrics::contract_cost> costs;
+      for( const auto& item : items ) {
+        if( item.trace != nullptr ) {
+          auto& c = costs[item.trace->act.account.value];
+          ++c.actions;
+          c.time_us += item.serialize_time.count();
+        }
+      }
+      metrics.add_contract_costs(costs);
+    }
+
+    if( batch_blocks ) {
+      // with multiple outputs, each one gets a batch with its own action
+      // traces, and all of the failed transactions
+      vector<vector<string>> action_traces(outputs.size());
+      vector<string> failed_transactions;
+      for( auto& item : items ) {
+        if( item.msgtype == MSGTYPE_ACTION_TRACE ) {
+          action_traces[std::max(item.shard, 0)].emplace_back(std::move(item.content));
+        }
+        else {
+          failed_transactions.emplace_back(std::move(item.content));
+        }
+      }
+      for( size_t i = 0; i < outputs.size(); ++i ) {
+        auto msg = new_message();
+        encode_batch(accepted, action_traces[i], failed_transactions, msg->data);
+        send_msg(std::move(msg), MSGTYPE_BLOCK_BATCH, action_opts() | MSGOPT_BATCH,
+                 0, outputs.size() > 1 ? int32_t(i) : -1);
+      }
+    }
+    else {
+      for( auto& item : items ) {
+        enqueue(zmq_outgoing_message{item.msgtype,
+                                     item.msgtype == MSGTYPE_ACTION_TRACE ? action_opts() : encoding_opts(),
+                                     std::move(item.msg), _end_block,
+                                     item.zao.global_action_seq, item.shard, std::move(item.topic)});
+      }
+    }
+
+    if( !delta_contracts.empty() ) {
+      send_table_deltas(block_num);
+    }
+
+    // traces of this block, and of speculative transactions that did not
+    // make it into it
+    cached_traces.prune(block_num);
+    if( cached_traces.evictions != reported_trace_evictions ) {
+      wlog("Trace cache limit reached, ${n} traces evicted",
+           ("n", cached_traces.evictions - reported_trace_evictions));
+      reported_trace_evictions = cached_traces.evictions;
+    }
+    metrics.trace_cache_size = cached_traces.size();
+    metrics.trace_cache_bytes = cached_traces.bytes();
+    metrics.trace_cache_hits = cached_traces.hits;
+    metrics.trace_cache_misses = cached_traces.misses;
+    metrics.trace_cache_evictions = cached_traces.evictions;
+    block_resource_balances.clear();
+    block_currency_balances.clear();
+
+    if( snapshot_requested.exchange(false) ) {
+      send_snapshot(block_num);
+    }
+    ++metrics.blocks;
+    metrics.accepted_block.add(fc::time_point::now() - start);
+  }
+
+
+  void zmq_plugin_impl::send_columnar_batches()
+  {
+    fc::microseconds encode_time;
+    for( size_t i = 0; i < columnar_batches.size(); ++i ) {
+      if( columnar_batches[i].empty() ) {
+        continue;
+      }
+      auto msg = new_message();
+      const auto start = fc::time_point::now();
+      columnar_batches[i].finish(msg->data);
+      encode_time += fc::time_point::now() - start;
+      send_msg(std::move(msg), MSGTYPE_COLUMNAR_BATCH, balance_deltas ? MSGOPT_BALANCE_DELTA : 0,
+               0, outputs.size() > 1 ? int32_t(i) : -1);
+    }
+    columnar_pending_blocks = 0;
+    metrics.columnar_encode.add(encode_time);
+  }
+
+
+  void zmq_plugin_impl::send_table_deltas( block_num_type block_num )
+  {
+    if( (block_subscriptions && !block_subscriptions->wants_msgtype(MSGTYPE_TABLE_DELTAS)) ||
+        !topic_wanted(default_topic(MSGTYPE_TABLE_DELTAS), -1) ) {
+      return;
+    }
+    zmq_table_deltas_object ztdo;
+    ztdo.block_num = block_num;
+    ztdo.deltas = state->get_table_deltas(block_num, delta_contracts);
+    if( ztdo.deltas.empty() ) {
+      return;
+    }
+    auto msg = new_message();
+    encode(ztdo, msg->data);
+    send_msg(std::move(msg), MSGTYPE_TABLE_DELTAS, encoding_opts());
+  }
+
+
+  void zmq_plugin_impl::send_snapshot( block_num_type block_num )
+  {
+    if( (block_subscriptions && !block_subscriptions->wants_msgtype(MSGTYPE_BALANCE_SNAPSHOT)) ||
+        !topic_wanted(default_topic(MSGTYPE_BALANCE_SNAPSHOT), -1) ) {
+      ilog("Balance snapshot at block ${b} skipped: no consumer subscribes to it", ("b", block_num));
+      return;
+    }
+    const auto start = fc::time_point::now();
+
+    struct chunk {
+      name                  contract;    // empty for resource balances
+      const vector<name>*   accounts;
+      size_t                begin;
+      size_t                end;
+      buffer_ptr            msg;
+    };
+
+    const vector<name> accounts = state->get_accounts();
+    vector<vector<name>> holders;
+    for( const auto& contract : snapshot_contracts ) {
+      holders.emplace_back(state->get_token_holders(contract));
+    }
+
+    vector<chunk> chunks;
+    auto add_chunks = [&](name contract, const vector<name>& list) {
+      for( size_t i = 0; i < list.size(); i += snapshot_chunk_size ) {
+        chunks.push_back(chunk{contract, &list, i, std::min<size_t>(i + snapshot_chunk_size, list.size()), buffer_ptr()});
+      }
+    };
+    add_chunks(name(), accounts);
+    for( size_t i = 0; i < snapshot_contracts.size(); ++i ) {
+      add_chunks(snapshot_contracts[i], holders[i]);
+    }
+
+    ilog("Sending balance snapshot at block ${b}: ${a} accounts, ${n} chunks",
+         ("b", block_num)("a", accounts.size())("n", chunks.size()));
+    if( current_block != nullptr ) {
+      current_block->snapshot = true;
+    }
+
+    auto fill = [&](size_t i) {
+      auto& c = chunks[i];
+      zmq_balance_snapshot_object snap;
+      snap.snapshot_block_num = block_num;
+      snap.chunk = i;
+      snap.chunks = chunks.size();
+      for( size_t a = c.begin; a < c.end; ++a ) {
+        const name account = (*c.accounts)[a];
+        if( c.contract.empty() ) {
+          snap.resource_balances.emplace_back(state->get_resource_balance(account));
+        }
+        else {
+          auto bal = state->get_currency_balances(account, c.contract);
+          snap.currency_balances.insert(snap.currency_balances.end(), bal.begin(), bal.end());
+        }
+      }
+      encode(snap, c.msg->data);
+    };
+
+    // chunks are processed in waves to bound the memory use
+    const size_t wave = 64;
+    for( size_t first = 0; first < chunks.size(); first += wave ) {
+      const size_t count = std::min(wave, chunks.size() - first);
+      for( size_t i = first; i < first + count; ++i ) {
+        chunks[i].msg = new_message();
+      }
+      if( serializers ) {
+        serializers->parallel_for(count, [&](size_t i) { fill(first + i); });
+      }
+      else {
+        for( size_t i = first; i < first + count; ++i ) {
+          fill(i);
+        }
+      }
+      for( size_t i = first; i < first + count; ++i ) {
+        send_msg(std::move(chunks[i].msg), MSGTYPE_BALANCE_SNAPSHOT, encoding_opts());
+      }
+    }
+
+    ilog("Balance snapshot at block ${b} sent in ${t} ms",
+         ("b", block_num)("t", (fc::time_point::now() - start).count() / 1000));
+  }
+
+
+  string zmq_plugin_impl::default_topic( int32_t msgtype )
+  {
+    return std::to_string(msgtype) + "/";
+  }
+
+
+  bool zmq_plugin_impl::topic_wanted( const string& topic, int32_t shard ) const
+  {
+    if( !pub_mode ) {
+      return true;
+    }
+    if( shard >= 0 ) {
+      return outputs[shard]->wants(topic);
+    }
+    for( const auto& out : outputs ) {
+      if( out->wants(topic) ) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+
+  int32_t zmq_plugin_impl::shard_of( const action_trace& at, const vector<name>& accounts ) const
+  {
+    name key = at.act.account;
+    switch( sharding ) {
+    case shard_key::contract:
+      break;
+    case shard_key::receiver:
+      key = at.receipt.receiver;
+      break;
+    case shard_key::accounts:
+      for( const auto& acc : accounts ) {
+        if( !system_accounts.contains(acc.value) ) {
+          key = acc;
+          break;
+        }
+      }
+      break;
+    }
+    const uint64_t h = key.value * 0x9E3779B97F4A7C15ULL;
+    return static_cast<int32_t>((h >> 32) % outputs.size());
+  }
+
+
+  bool zmq_plugin_impl::prepare_action( const action_trace& at, const block_state_ptr& block_state, block_item& item )
+  {
+    // filters are checked before any expensive work is done
+    if( !whitelist.empty() && !whitelist.matches(at) ) {
+      return false;
+    }
+    if( blacklist.matches(at) ) {
+      return false;
+    }
+
+    item.msgtype = MSGTYPE_ACTION_TRACE;
+    item.trace = &at;
+    zmq_action_object& zao = item.zao;
+    zao.global_action_seq = at.receipt.global_sequence;
+    zao.block_num = block_state->block->block_num();
+    zao.block_time = block_state->block->timestamp;
+
+    // the vectors are reused for every action
+    auto& accounts = action_accounts;
+    auto& token_contracts = action_token_contracts;
+    accounts.clear();
+    token_contracts.clear();
+    find_accounts_and_tokens(at, accounts, token_contracts);
+    make_unique(accounts);
+    make_unique(token_contracts);
+
+    if( block_subscriptions && !block_subscriptions->wants_action(at, accounts) ) {
+      return false;
+    }
+
+    if( outputs.size() > 1 ) {
+      item.shard = shard_of(at, accounts);
+    }
+
+    if( batch_blocks || columnar_blocks > 0 ) {
+      // the action travels in a block-level message, under its topic
+      if( !topic_wanted(default_topic(batch_blocks ? MSGTYPE_BLOCK_BATCH : MSGTYPE_COLUMNAR_BATCH), item.shard) ) {
+        return false;
+      }
+    }
+    else if( pub_mode ) {
+      item.topic = std::to_string(MSGTYPE_ACTION_TRACE) + "/" + at.act.account.to_string() + "/" +
+        at.act.name.to_string() + "/";
+      if( !topic_wanted(item.topic, item.shard) ) {
+        return false;
+      }
+    }
+
+    sent_balances* sent = balance_deltas ? &sent_balances_by_output[std::max(item.shard, 0)] : nullptr;
+    for (auto it = accounts.begin(); it != accounts.end(); ++it) {
+      name account_name = *it;
+      if( is_account_of_interest(account_name) ) {
+        add_account_resource( zao, account_name, sent );
+        for (auto it2 = token_contracts.begin(); it2 != token_contracts.end(); ++it2) {
+          add_currency_balances( zao, account_name, *it2, sent );
+        }
+      }
+    }
+
+    zao.last_irreversible_block = state->last_irreversible_block_num();
+    if( schema_registry ) {
+      zao.schemas = vector<zmq_schema_ref>();
+      collect_schemas(at, *zao.schemas);
+    }
+    return true;
+  }
+
+
+  void zmq_plugin_impl::collect_schemas( const action_trace& at, vector<zmq_schema_ref>& refs )
+  {
+    const name account = at.act.account;
+    const bool listed = std::any_of(refs.begin(), refs.end(),
+                                    [&](const zmq_schema_ref& r) { return r.account == account; });
+    uint64_t abi_sequence = 0;
+    if( !listed && state->get_abi_sequence(account, abi_sequence) ) {
+      refs.emplace_back(zmq_schema_ref{account, abi_sequence});
+      send_schema(account, abi_sequence);
+    }
+    for( const auto& iline : at.inline_traces ) {
+      collect_schemas( iline, refs );
+    }
+  }
+
+
+  void zmq_plugin_impl::send_schema( name account, uint64_t abi_sequence )
+  {
+    auto it = sent_schemas.find(account.value);
+    if( it != sent_schemas.end() && it->second == abi_sequence ) {
+      return;
+    }
+    if( (block_subscriptions && !block_subscriptions->wants_msgtype(MSGTYPE_SCHEMA)) ||
+        !topic_wanted(default_topic(MSGTYPE_SCHEMA), -1) ) {
+      return;
+    }
+    zmq_schema_object zso;
+    zso.account = account;
+    zso.schema_id = abi_sequence;
+    zso.block_num = _end_block;
+    try {
+      const bytes raw_abi = state->get_abi(account);
+      if( recorder ) {
+        recorder->record_abi(account, abi_sequence, raw_abi);
+      }
+      // an account without a valid ABI gets an empty one
+      abi_serializer::to_abi(raw_abi, zso.abi);
+    } FC_CAPTURE_AND_LOG((account))
+
+    // recorded before enqueueing, as a dropped message clears the record
+    sent_schemas[account.value] = abi_sequence;
+    auto msg = new_message();
+    encode(zso, msg->data);
+    send_msg(std::move(msg), MSGTYPE_SCHEMA, encoding_opts());
+  }
+
+
+  void zmq_plugin_impl::serialize_actions( vector<block_item>& items )
+  {
+    // with the schema registry, no ABI is resolved and action data stays raw
+    if( !serializers ) {
+      for( auto& item : items ) {
+        if( item.trace != nullptr ) {
+          serialize_action(item, [&](const account_name& n) {
+              return schema_registry ? abi_serializer_ref() : resolve_abi(n);
+            });
+        }
+      }
+      return;
+    }
+
+    // ABI lookups need the chain state, so they are resolved beforehand
+    std::unordered_map<uint64_t, abi_serializer_ref> abis;
+    if( !binary_encoding && !schema_registry ) {
+      for( const auto& item : items ) {
+        if( item.trace != nullptr ) {
+          collect_abis(*item.trace, abis);
+        }
+      }
+    }
+
+    auto resolver = [&abis](const account_name& n) {
+      auto it = abis.find(n.value);
+      return (it != abis.end()) ? it->second : abi_serializer_ref();
+    };
+
+    serializers->parallel_for(items.size(), [&](size_t i) {
+        if( items[i].trace != nullptr ) {
+          serialize_action(items[i], resolver);
+        }
+      });
+  }
+
+
+  template<typename Resolver>
+  void zmq_plugin_impl::serialize_action( block_item& item, Resolver resolver ) const
+  {
+    const auto start = fc::time_point::now();
+    if( !binary_encoding && streaming_json ) {
+      json_writer(item.output()).action_object(item.zao, *item.trace, resolver, abi_serializer_max_time);
+    }
+    else {
+      if( !binary_encoding ) {
+        abi_serializer::to_variant(*item.trace, item.zao.action_trace, resolver, abi_serializer_max_time);
+      }
+      encode_action(item.zao, *item.trace, item.output());
+      item.zao.action_trace.clear();
+    }
+    item.serialize_time = fc::time_point::now() - start;
+  }
+
+
+  void zmq_plugin_impl::collect_abis( const action_trace& at, std::unordered_map<uint64_t, abi_serializer_ref>& abis )
+  {
+    if( abis.find(at.act.account.value) == abis.end() ) {
+      abis.emplace(at.act.account.value, resolve_abi(at.act.account));
+    }
+    for( const auto& iline : at.inline_traces ) {
+      collect_abis( iline, abis );
+    }
+  }
+
+
+  void zmq_plugin_impl::control_loop()
+  {
+    std::vector<zmq::socket_t*> sockets;
+    std::vector<zmq::pollitem_t> items;
+    for( auto* sock : { control_socket.get(), journal_socket.get() } ) {
+      if( sock != nullptr ) {
+        sockets.push_back(sock);
+        items.push_back(zmq::pollitem_t{ (void*) *sock, 0, ZMQ_POLLIN, 0 });
+      }
+    }
+
+    while( !done.load() ) {
+      zmq::poll(items.data(), items.size(), 200);
+      for( size_t i = 0; i < items.size(); ++i ) {
+        if( (items[i].revents & ZMQ_POLLIN) == 0 ) {
+          continue;
+        }
+
+        zmq::message_t request;
+        if( !sockets[i]->recv(&request, ZMQ_DONTWAIT) ) {
+          continue;
+        }
+        string text((const char*) request.data(), request.size());
+
+        if( sockets[i] == journal_socket.get() ) {
+          handle_replay_request(text);
+          continue;
+        }
+
+        string reply = handle_control_request(text);
+        zmq::message_t response(reply.size());
+        memcpy(response.data(), reply.data(), reply.size());
+        sockets[i]->send(response);
+      }
+    }
+  }
+
+
+  void zmq_plugin_impl::trim_journal()
+  {
+    const block_num_type lib = irreversible_block_num.load();
+    if( lib > journal_retention && lib != journal_trimmed_at ) {
+      journal_trimmed_at = lib;
+      journal->trim(lib - journal_retention);
+    }
+  }
+
+
+  void zmq_plugin_impl::handle_replay_request(const string& text)
+  {
+    fc::mutable_variant_object status;
+    std::vector<string> frames;
+    try {
+      const auto req = fc::json::from_string(text).get_object();
+      uint32_t max_messages = JOURNAL_MAX_REPLAY_MESSAGES;
+      if( req.contains("max_messages") ) {
+        max_messages = std::min(req["max_messages"].as<uint32_t>(), JOURNAL_MAX_REPLAY_MESSAGES);
+      }
+
+      uint64_t from;
+      if( req.contains("from_index") ) {
+        from = req["from_index"].as<uint64_t>();
+      }
+      else if( req.contains("after_action_seq") ) {
+        from = journal->find_after_action(req["after_action_seq"].as<uint64_t>());
+      }
+      else if( req.contains("from_block") ) {
+        from = journal->find_block(req["from_block"].as<block_num_type>());
+      }
+      else {
+        EOS_ASSERT( false, plugin_exception, "one of from_index, from_block, after_action_seq is required" );
+      }
+
+      const uint64_t first = journal->first_index();
+      EOS_ASSERT( from >= first, plugin_exception,
+                  "Journal index ${i} is trimmed, the oldest available is ${f}", ("i", from)("f", first) );
+
+      // with sharded output, a consumer may ask for the messages of its shard only
+      int32_t shard = -1;
+      if( req.contains("shard") ) {
+        shard = req["shard"].as<int32_t>();
+      }
+
+      uint64_t next = journal->read(from, max_messages, [&](const message_journal::record& r) {
+          if( shard >= 0 && r.header->shard >= 0 && r.header->shard != shard ) {
+            return false;
+          }
+          frames.emplace_back(r.data, r.header->size);
+          return true;
+        });
+
+      status("status", "ok")("count", frames.size())("next_index", next)
+        ("last_index", journal->next_index());
+    }
+    catch( const fc::exception& e ) {
+      frames.clear();
+      status("status", "error")("message", e.to_string());
+    }
+    catch( const std::exception& e ) {
+      frames.clear();
+      status("status", "error")("message", e.what());
+    }
+
+    string head = fc::json::to_string(status);
+    zmq::message_t response(head.size());
+    memcpy(response.data(), head.data(), head.size());
+    journal_socket->send(response, frames.empty() ? 0 : ZMQ_SNDMORE);
+    for( size_t i = 0; i < frames.size(); ++i ) {
+      zmq::message_t frame(frames[i].size());
+      memcpy(frame.data(), frames[i].data(), frames[i].size());
+      journal_socket->send(frame, (i + 1 < frames.size()) ? ZMQ_SNDMORE : 0);
+    }
+  }
+
+
+  string zmq_plugin_impl::handle_control_request(const string& text)
+  {
+    fc::mutable_variant_object reply;
+    try {
+      const fc::variant req = fc::json::from_string(text);
+      const string type = req.get_object()["request"].as_string();
+
+      if( type == "subscribe" ) {
+        auto sub = req.as<zmq_subscription>();
+        EOS_ASSERT( !sub.consumer.empty(), plugin_exception, "consumer is not specified" );
+        subscription_specs[sub.consumer] = sub;
+        publish_subscriptions();
+        ilog("ZMQ consumer ${c} subscribed", ("c", sub.consumer));
+      }
+      else if( type == "unsubscribe" ) {
+        const string consumer = req.get_object()["consumer"].as_string();
+        subscription_specs.erase(consumer);
+        publish_subscriptions();
+        ilog("ZMQ consumer ${c} unsubscribed", ("c", consumer));
+      }
+      else if( type == "refresh_balances" ) {
+        balance_refresh_requested = true;
+        ilog("ZMQ balance refresh requested");
+      }
+      else if( type == "schemas" ) {
+        schemas_reset_requested = true;
+        ilog("ZMQ schemas requested");
+      }
+      else if( type == "snapshot" ) {
+        // the control socket is not authenticated, and the snapshot
+        // pauses block processing
+        EOS_ASSERT( snapshot_on_request, plugin_exception, "Snapshot requests are disabled" );
+        snapshot_requested = true;
+        ilog("ZMQ balance snapshot requested");
+      }
+      else if( type == "list" ) {
+        vector<zmq_subscription> subs;
+        for( const auto& s : subscription_specs ) {
+          subs.emplace_back(s.second);
+        }
+        reply("subscriptions", subs);
+      }
+      else {
+        EOS_ASSERT( false, plugin_exception, "Unknown request: ${r}", ("r", type) );
+      }
+      reply("status", "ok");
+    }
+    catch( const fc::exception& e ) {
+      reply("status", "error")("message", e.to_string());
+    }
+    catch( const std::exception& e ) {
+      reply("status", "error")("message", e.what());
+    }
+    return fc::json::to_string(reply);
+  }
+
+
+  void zmq_plugin_impl::publish_subscriptions()
+  {
+    std::shared_ptr<const subscription_set> subs;
+    if( !subscription_specs.empty() ) {
+      subs = std::make_shared<const subscription_set>(subscription_specs);
+    }
+    std::atomic_store(&subscriptions, subs);
+  }
+
+
+  abi_serializer_ref zmq_plugin_impl::resolve_abi(const account_name& n)
+  {
+    abi_serializer_ref result;
+    if( !n.good() ) {
+      return result;
+    }
+
+    uint64_t abi_sequence = 0;
+    if( !state->get_abi_sequence(n, abi_sequence) ) {
+      return result;
+    }
+
+    if( !abi_serializers.find(n, abi_sequence, result) ) {
+      try {
+        const bytes raw_abi = state->get_abi(n);
+        if( recorder ) {
+          recorder->record_abi(n, abi_sequence, raw_abi);
+        }
+        abi_def abi;
+        if( abi_serializer::to_abi(raw_abi, abi) ) {
+          result.ptr = std::make_shared<const abi_serializer>(abi, abi_serializer_max_time);
+        }
+      } FC_CAPTURE_AND_LOG((n))
+      // accounts without a valid ABI are cached too
+      abi_serializers.insert(n, abi_sequence, result);
+    }
+    return result;
+  }
+
+
+  void zmq_plugin_impl::on_irreversible_block( const chain::block_state_ptr& bs )
+  {
+    irreversible_block_num = bs->block->block_num();
+
+    if( irreversible_only ) {
+      release_block(bs->block->block_num(), bs->block->digest());
+    }
+
+    zmq_irreversible_block_object zibo;
+    zibo.irreversible_block_num = bs->block->block_num();
+    zibo.irreversible_block_digest = bs->block->digest();
+    auto msg = new_message();
+    encode(zibo, msg->data);
+    send_msg(std::move(msg), MSGTYPE_IRREVERSIBLE_BLOCK, encoding_opts());
+  }
+
+
+  void zmq_plugin_impl::release_block( block_num_type block_num, const digest_type& digest )
+  {
+    auto it = reversible_blocks.begin();
+    for( ; it != reversible_blocks.end() && it->first < block_num; ++it ) {
+      wlog("Discarding ${n} messages of block ${b} which did not become irreversible",
+           ("n", it->second.messages.size())("b", it->first));
+      forget_sent_state();
+      if( it->second.snapshot ) {
+        snapshot_requested = true;
+      }
+    }
+    if( it != reversible_blocks.end() && it->first == block_num ) {
+      if( it->second.digest == digest ) {
+        for( auto& msg : it->second.messages ) {
+          enqueue(std::move(msg));
+        }
+        release_columnar(it->second);
+      }
+      else {
+        wlog("Discarding ${n} messages of block ${b}: the irreversible block has a different digest",
+             ("n", it->second.messages.size())("b", block_num));
+        forget_sent_state();
+        if( it->second.snapshot ) {
+          snapshot_requested = true;
+        }
+      }
+      ++it;
+    }
+    reversible_blocks.erase(reversible_blocks.begin(), it);
+  }
+
+
+  void zmq_plugin_impl::release_columnar( reversible_block& rb )
+  {
+    if( columnar_blocks == 0 ) {
+      return;
+    }
+    // the number of outputs may have changed since the block was saved
+    for( size_t i = 0; i < rb.columnar.size(); ++i ) {
+      columnar_batches[i % columnar_batches.size()].append(rb.columnar[i]);
+    }
+    if( ++columnar_pending_blocks >= columnar_blocks ) {
+      send_columnar_batches();
+    }
+  }
+
+
+  void zmq_plugin_impl::save_reversible_blocks( const bfs::path& file )
+  {
+    if( reversible_blocks.empty() ) {
+      return;
+    }
+    const block_num_type first = reversible_blocks.begin()->first;
+    const block_num_type last = reversible_blocks.rbegin()->first;
+    uint64_t count = 0;
+    vector<saved_block> blocks;
+    for( auto& rb : reversible_blocks ) {
+      blocks.emplace_back();
+      blocks.back().block_num = rb.first;
+      blocks.back().digest = rb.second.digest;
+      for( auto& msg : rb.second.messages ) {
+        blocks.back().messages.emplace_back(saved_message{msg.msgtype, msg.msgopts, msg.global_action_seq,
+                                                          msg.shard, msg.topic, std::move(msg.content->data)});
+        ++count;
+      }
+      for( auto& batch : rb.second.columnar ) {
+        blocks.back().columnar.emplace_back(std::move(batch.rows()));
+      }
+    }
+    reversible_blocks.clear();
+
+    try {
+      std::ofstream out(file.generic_string(), std::ios::binary | std::ios::trunc);
+      char head[sizeof(first) + sizeof(last) + sizeof(count)];
+      fc::datastream<char*> ds(head, sizeof(head));
+      fc::raw::pack(ds, first);
+      fc::raw::pack(ds, last);
+      fc::raw::pack(ds, count);
+      out.write(head, sizeof(head));
+      const auto payload = fc::raw::pack(blocks);
+      out.write(payload.data(), payload.size());
+      out.close();
+      EOS_ASSERT( !out.fail(), plugin_exception, "Cannot write ${f}", ("f", file.generic_string()) );
+      ilog("Saved ${n} messages of reversible blocks ${b}-${l} to ${f}",
+           ("n", count)("b", first)("l", last)("f", file.generic_string()));
+    }
+    catch( const fc::exception& e ) {
+      elog("${e}", ("e", e.to_string()));
+      report_lost_messages(count, first, last);
+    }
+  }
+
+
+  void zmq_plugin_impl::load_reversible_blocks( const bfs::path& file )
+  {
+    if( !bfs::exists(file) ) {
+      return;
+    }
+    vector<char> data(bfs::file_size(file));
+    {
+      std::ifstream in(file.generic_string(), std::ios::binary);
+      in.read(data.data(), data.size());
+    }
+    bfs::remove(file);
+
+    block_num_type first = 0;
+    block_num_type last = 0;
+    uint64_t count = 0;
+    try {
+      fc::datastream<const char*> ds(data.data(), data.size());
+      fc::raw::unpack(ds, first);
+      fc::raw::unpack(ds, last);
+      fc::raw::unpack(ds, count);
+      if( !irreversible_only ) {
+        wlog("${f} is left from irreversible-only mode, which is now disabled", ("f", file.generic_string()));
+        report_lost_messages(count, first, last);
+        return;
+      }
+      vector<saved_block> blocks;
+      fc::raw::unpack(ds, blocks);
+      for( auto& sb : blocks ) {
+        auto& rb = reversible_blocks[sb.block_num];
+        rb.digest = sb.digest;
+        for( auto& sm : sb.messages ) {
+          rb.snapshot = rb.snapshot || sm.msgtype == MSGTYPE_BALANCE_SNAPSHOT;
+          auto content = new_message();
+          content->data = std::move(sm.content);
+          rb.messages.emplace_back(zmq_outgoing_message{sm.msgtype, sm.msgopts, std::move(content), sb.block_num,
+                                                        sm.global_action_seq, sm.shard, std::move(sm.topic)});
+        }
+        rb.columnar.resize(sb.columnar.size());
+        for( size_t i = 0; i < sb.columnar.size(); ++i ) {
+          rb.columnar[i].rows() = std::move(sb.columnar[i]);
+        }
+      }
+      ilog("Loaded ${n} messages of reversible blocks ${b}-${l} from ${f}",
+           ("n", count)("b", first)("l", last)("f", file.generic_string()));
+    }
+    catch( const fc::exception& e ) {
+      elog("Cannot read ${f}: ${e}", ("f", file.generic_string())("e", e.to_string()));
+      reversible_blocks.clear();
+      if( count > 0 ) {
+        report_lost_messages(count, first, last);
+      }
+    }
+  }
+
+
+  void zmq_plugin_impl::report_lost_messages( uint64_t count, block_num_type first, block_num_type last )
+  {
+    elog("${n} ZMQ messages of blocks ${f}-${l} are lost", ("n", count)("f", first)("l", last));
+    forget_sent_state();
+    zmq_gap_object zgo;
+    zgo.dropped_messages = count;
+    zgo.first_block_num = first;
+    zgo.last_block_num = last;
+    auto msg = new_message();
+    encode(zgo, msg->data);
+    enqueue(zmq_outgoing_message{MSGTYPE_GAP, encoding_opts(), std::move(msg), last});
+  }
+
+
+  void zmq_plugin_impl::find_accounts_and_tokens(const action_trace& at,
+                                                 vector<name>& accounts,
+                                                 vector<name>& token_contracts)
+  {
+    extractor.extract(at, accounts, token_contracts);
+
+    if( at.act.account == config::system_account_name && at.act.name == N(setabi) ) {
+      abi_serializers.erase(account_extractor::name_at(at.act.data, 0));
+    }
+
+    for( const auto& iline : at.inline_traces ) {
+      find_accounts_and_tokens( iline, accounts, token_contracts );
+    }
+  }
+
+
+  void zmq_plugin_impl::make_unique(vector<name>& names)
+  {
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+  }
+
+
+  bool zmq_plugin_impl::is_account_of_interest(name account_name)
+  {
+    return !system_accounts.contains(account_name.value);
+  }
+
+
+  void zmq_plugin_impl::add_account_resource( zmq_action_object& zao, name account_name, sent_balances* sent )
+  {
+    auto cached = block_resource_balances.find(account_name.value);
+    if( cached == block_resource_balances.end() ) {
+      cached = block_resource_balances.emplace(account_name.value, state->get_resource_balance(account_name)).first;
+    }
+    if( sent == nullptr || sent->update(cached->second) ) {
+      zao.resource_balances.emplace_back(cached->second);
+    }
+  }
+
+
+  void zmq_plugin_impl::add_currency_balances( zmq_action_object& zao,
+                                               name account_name, name token_code, sent_balances* sent )
+  {
+    auto key = std::make_pair(account_name.value, token_code.value);
+    auto cached = block_currency_balances.find(key);
+    if( cached == block_currency_balances.end() ) {
+      cached = block_currency_balances.emplace(key, state->get_currency_balances(account_name, token_code)).first;
+    }
+    if( sent != nullptr ) {
+      sent->update(account_name, token_code, cached->second, zao.currency_balances);
+      return;
+    }
+    zao.currency_balances.insert(zao.currency_balances.end(),
+                                 cached->second.begin(), cached->second.end());
+  }
+}
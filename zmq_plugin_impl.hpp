@@ -0,0 +1,3361 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *  @author cc32d9 <cc32d9@gmail.com>
+ *
+ *  Internal to zmq_plugin: the message pipeline, shared by the plugin and
+ *  the offline benchmark. The zmq_plugin_impl members are defined in
+ *  zmq_plugin_impl.cpp, and its configuration in zmq_plugin.cpp. Not
+ *  installed.
+ */
+#pragma once
+#include <eosio/zmq_plugin/zmq_plugin.hpp>
+#include <string>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <tuple>
+#include <type_traits>
+#include <zmq.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#ifdef ZMQ_PLUGIN_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef ZMQ_PLUGIN_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ZMQ_PLUGIN_HAVE_ARROW
+#include <arrow/api.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/writer.h>
+#endif
+#include <fc/io/json.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/scoped_exit.hpp>
+
+#include <eosio/chain/types.hpp>
+#include <eosio/chain/controller.hpp>
+#include <eosio/chain/trace.hpp>
+#include <eosio/chain/abi_serializer.hpp>
+#include <eosio/chain/account_object.hpp>
+#include <eosio/chain/contract_table_objects.hpp>
+#include <eosio/chain_plugin/chain_plugin.hpp>
+#include <eosio/http_plugin/http_plugin.hpp>
+
+namespace {
+  const uint32_t QUEUE_SIZE_DEFAULT = 10000;
+  const uint32_t BALANCE_REFRESH_DEFAULT = 7200;
+  const uint32_t SNAPSHOT_CHUNK_DEFAULT = 1000;
+  const uint32_t JOURNAL_RETENTION_DEFAULT = 1000;
+  const uint32_t JOURNAL_MAX_REPLAY_MESSAGES = 10000;
+  const int32_t MSGTYPE_ACTION_TRACE = 0;
+  const int32_t MSGTYPE_IRREVERSIBLE_BLOCK = 1;
+  const int32_t MSGTYPE_FORK = 2;
+  const int32_t MSGTYPE_ACCEPTED_BLOCK = 3;
+  const int32_t MSGTYPE_FAILED_TX = 4;
+  const int32_t MSGTYPE_GAP = 5;
+  const int32_t MSGTYPE_BLOCK_BATCH = 6;
+  const int32_t MSGTYPE_BALANCE_SNAPSHOT = 7;
+  const int32_t MSGTYPE_TABLE_DELTAS = 8;
+  const int32_t MSGTYPE_SCHEMA = 9;
+  const int32_t MSGTYPE_COLUMNAR_BATCH = 10;
+
+  // msgopts bit flags
+  const int32_t MSGOPT_BINARY = 1;
+  const int32_t MSGOPT_BATCH = 2;
+  const int32_t MSGOPT_LZ4 = 4;
+  const int32_t MSGOPT_ZSTD = 8;
+  const int32_t MSGOPT_BALANCE_DELTA = 16;
+}
+
+namespace zmqplugin {
+  using namespace eosio;
+  using namespace eosio::chain;
+  using account_resource_limit = chain::resource_limits::account_resource_limit;
+
+  struct resource_balance {
+    name                       account_name;
+    int64_t                    ram_quota  = 0;
+    int64_t                    ram_usage = 0;
+    int64_t                    net_weight = 0;
+    int64_t                    cpu_weight = 0;
+    account_resource_limit     net_limit;
+    account_resource_limit     cpu_limit;
+  };
+
+  struct currency_balance {
+    name                       account_name;
+    name                       contract;
+    asset                      balance;
+  };
+
+  // ABI of a contract as announced in a schema message. The ABI sequence
+  // number of the account serves as the schema id.
+  struct zmq_schema_ref {
+    name                         account;
+    uint64_t                     schema_id;
+  };
+
+  struct zmq_action_object {
+    uint64_t                     global_action_seq;
+    block_num_type               block_num;
+    chain::block_timestamp_type  block_time;
+    fc::variant                  action_trace;
+    vector<resource_balance>     resource_balances;
+    vector<currency_balance>     currency_balances;
+    uint32_t                     last_irreversible_block;
+    fc::optional<vector<zmq_schema_ref>> schemas;  // only with the schema registry
+  };
+
+  struct zmq_schema_object {
+    name                         account;
+    uint64_t                     schema_id;
+    block_num_type               block_num;
+    abi_def                      abi;
+  };
+
+  struct zmq_irreversible_block_object {
+    block_num_type               irreversible_block_num;
+    digest_type                  irreversible_block_digest;
+  };
+
+  struct zmq_fork_block_object {
+    block_num_type                    invalid_block_num;
+  };
+
+  struct zmq_accepted_block_object {
+    block_num_type               accepted_block_num;
+    digest_type                  accepted_block_digest;
+  };
+
+  // see status definitions in libraries/chain/include/eosio/chain/block.hpp
+  struct zmq_failed_transaction_object {
+    string                                         trx_id;
+    block_num_type                                 block_num;
+    eosio::chain::transaction_receipt::status_enum status_name; // enum
+    uint8_t                                        status_int;  // the same as status, but integer
+  };
+
+  // Contract table row changed in a block. The value is the new row, or
+  // the old row if it was removed.
+  struct zmq_table_delta {
+    string                                         operation;  // insert, update or remove
+    name                                           code;
+    name                                           scope;
+    name                                           table;
+    uint64_t                                       primary_key;
+    name                                           payer;
+    bytes                                          value;
+  };
+
+  struct zmq_table_deltas_object {
+    block_num_type                                 block_num;
+    vector<zmq_table_delta>                        deltas;
+  };
+
+  // consumer subscription, as received on the control socket. Empty lists
+  // match everything.
+  struct zmq_subscription {
+    string                       consumer;
+    vector<name>                 contracts;
+    vector<name>                 actions;
+    vector<name>                 accounts;
+    vector<int32_t>              msgtypes;
+  };
+
+  // sent in place of messages dropped because the sender queue was full
+  struct zmq_gap_object {
+    uint64_t                     dropped_messages;
+    block_num_type               first_block_num;
+    block_num_type               last_block_num;
+  };
+
+  // One chunk of a balance snapshot. A chunk contains either resource
+  // balances or currency balances of one token contract.
+  struct zmq_balance_snapshot_object {
+    block_num_type               snapshot_block_num;
+    uint32_t                     chunk;
+    uint32_t                     chunks;
+    vector<resource_balance>     resource_balances;
+    vector<currency_balance>     currency_balances;
+  };
+
+  enum class overflow_policy {
+    block,   // chain thread waits until the sender thread frees a slot
+    spill,   // excess messages are kept in an unbounded in-memory list
+    drop     // excess messages are discarded and a gap marker is sent
+  };
+
+  class buffer_pool;
+
+  // Message buffer: the 8-byte header (msgtype, msgopts) followed by the
+  // data. The buffer is handed over to ZMQ without copying, and ZMQ returns
+  // it to the pool once the message is transmitted.
+  struct pooled_buffer {
+    string                       data;
+    buffer_pool*                 pool = nullptr;
+  };
+
+  struct buffer_releaser {
+    void operator()(pooled_buffer* buf) const;
+  };
+
+  using buffer_ptr = std::unique_ptr<pooled_buffer, buffer_releaser>;
+
+  class buffer_pool {
+  public:
+    static const size_t HEADER_SIZE = sizeof(int32_t) * 2;
+    // larger buffers are freed instead of being kept in the pool
+    static const size_t MAX_POOLED_CAPACITY = 1024 * 1024;
+    static const size_t MAX_POOLED_BUFFERS = 1024;
+
+    ~buffer_pool()
+    {
+      for( auto* buf : _free ) {
+        delete buf;
+      }
+    }
+
+    // Returns a buffer with zeroed space for the header
+    buffer_ptr acquire()
+    {
+      pooled_buffer* buf = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if( !_free.empty() ) {
+          buf = _free.back();
+          _free.pop_back();
+        }
+      }
+      if( buf == nullptr ) {
+        buf = new pooled_buffer();
+        buf->pool = this;
+      }
+      buf->data.assign(HEADER_SIZE, '\0');
+      return buffer_ptr(buf);
+    }
+
+    void release(pooled_buffer* buf)
+    {
+      if( buf->data.capacity() <= MAX_POOLED_CAPACITY ) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if( _free.size() < MAX_POOLED_BUFFERS ) {
+          _free.push_back(buf);
+          return;
+        }
+      }
+      delete buf;
+    }
+
+    // zmq_free_fn, called by ZMQ when it no longer needs the message data
+    static void zmq_free(void*, void* hint)
+    {
+      auto* buf = static_cast<pooled_buffer*>(hint);
+      buf->pool->release(buf);
+    }
+
+  private:
+    std::mutex                   _mtx;
+    std::vector<pooled_buffer*>  _free;
+  };
+
+  inline void buffer_releaser::operator()(pooled_buffer* buf) const
+  {
+    buf->pool->release(buf);
+  }
+
+  struct zmq_outgoing_message {
+    int32_t                      msgtype = 0;
+    int32_t                      msgopts = 0;
+    buffer_ptr                   content;
+    block_num_type               block_num = 0;
+    uint64_t                     global_action_seq = 0;
+    int32_t                      shard = -1;  // output socket index, -1 for all
+    string                       topic;       // PUB mode topic, "<msgtype>/" if empty
+  };
+
+  enum class shard_key {
+    contract,  // account of the action
+    receiver,  // receiver of the action
+    accounts   // lowest-named account of interest involved in the action
+  };
+
+  enum class sender_type {
+    push,    // PUSH socket, blocks when no consumer is able to receive
+    pub,     // XPUB socket with topic frames
+    router   // ROUTER socket with credit-based flow control
+  };
+
+  struct sender_options {
+    sender_type                  type = sender_type::push;
+    fc::microseconds             router_timeout;
+    uint32_t                     router_max_pending = 0;
+  };
+
+  // One bound output socket of the sender thread.
+  //
+  // In PUB mode, the socket is XPUB, every message is preceded by a topic
+  // frame, and the set of subscribed topic prefixes is tracked for the
+  // chain thread.
+  //
+  // In ROUTER mode, consumers connect with DEALER sockets and send JSON
+  // requests: {"credit":N} allows N more messages to be sent to the
+  // consumer, and {"ack":ID} confirms the messages up to the one with
+  // delivery ID, in the order they were sent to this consumer. Every
+  // message is sent as two frames: the 64-bit delivery ID and the message
+  // itself. Unacknowledged messages of a consumer that is silent for longer
+  // than the timeout, or cannot be reached, are delivered to other
+  // consumers with the same delivery ID.
+  class sender_output {
+  public:
+    sender_output(zmq::context_t& context, const string& endpoint, const sender_options& opts):
+      _socket(context, socket_type(opts.type)),
+      _endpoint(endpoint),
+      _opts(opts)
+    {
+      if( _opts.type == sender_type::router ) {
+        int mandatory = 1;
+        _socket.setsockopt(ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(mandatory));
+      }
+      _socket.bind(_endpoint);
+      if( _opts.type == sender_type::pub ) {
+        std::atomic_store(&_published_topics, std::make_shared<const std::set<string>>());
+      }
+    }
+
+    // Sends the message, waiting for the socket to become writable. Returns
+    // false if the plugin is shutting down and the message could not be sent.
+    bool send(zmq::message_t& message, const string& topic, const std::atomic<bool>& done)
+    {
+      switch( _opts.type ) {
+      case sender_type::pub:
+        {
+          zmq::message_t topic_frame(topic.size());
+          memcpy(topic_frame.data(), topic.data(), topic.size());
+          if( !send_frame(topic_frame, ZMQ_SNDMORE, done) ) {
+            return false;
+          }
+        }
+        break;
+      case sender_type::router:
+        // waiting for credits makes the sender queue fill up, and then the
+        // overflow policy applies
+        while( _pending.size() >= _opts.router_max_pending ) {
+          if( done.load() ) {
+            return false;
+          }
+          zmq::pollitem_t items[] = {{ (void*) _socket, 0, ZMQ_POLLIN, 0 }};
+          zmq::poll(items, 1, 100);
+          poll_incoming();
+        }
+        _pending.emplace_back();
+        _pending.back().id = _next_delivery_id++;
+        _pending.back().msg.move(&message);
+        dispatch();
+        return true;
+      case sender_type::push:
+        break;
+      }
+      return send_frame(message, 0, done);
+    }
+
+    // Processes incoming messages: XPUB subscription events, or ROUTER
+    // consumer credits and acknowledgements
+    void poll_incoming()
+    {
+      if( _opts.type == sender_type::pub ) {
+        poll_subscriptions();
+      }
+      else if( _opts.type == sender_type::router ) {
+        poll_consumers();
+        dispatch();
+      }
+    }
+
+    // Called on the chain thread. Always true unless in PUB mode.
+    bool wants(const string& topic) const
+    {
+      if( _opts.type != sender_type::pub ) {
+        return true;
+      }
+      auto topics = std::atomic_load(&_published_topics);
+      for( const auto& prefix : *topics ) {
+        if( topic.compare(0, prefix.size(), prefix) == 0 ) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void close()
+    {
+      if( !_pending.empty() ) {
+        wlog("ZMQ ROUTER socket ${e} closing with ${n} undelivered messages",
+             ("e", _endpoint)("n", _pending.size()));
+      }
+      _socket.close();
+    }
+
+    const string& endpoint() const { return _endpoint; }
+
+  private:
+    struct delivery {
+      uint64_t                  id = 0;
+      zmq::message_t            msg;
+    };
+
+    struct consumer {
+      uint64_t                  credit = 0;
+      std::deque<delivery>      in_flight;
+      fc::time_point            last_seen;
+    };
+
+    static int socket_type(sender_type type)
+    {
+      switch( type ) {
+      case sender_type::pub:    return ZMQ_XPUB;
+      case sender_type::router: return ZMQ_ROUTER;
+      case sender_type::push:   break;
+      }
+      return ZMQ_PUSH;
+    }
+
+    bool send_frame(zmq::message_t& frame, int flags, const std::atomic<bool>& done)
+    {
+      while( !_socket.send(frame, flags | ZMQ_DONTWAIT) ) {
+        if( done.load() ) {
+          return false;
+        }
+        zmq::pollitem_t items[] = {{ (void*) _socket, 0, ZMQ_POLLOUT, 0 }};
+        zmq::poll(items, 1, 100);
+      }
+      return true;
+    }
+
+    // Only the first subscription and the last unsubscription of a prefix
+    // are reported by XPUB, so the set of prefixes is the union of all
+    // subscribers.
+    void poll_subscriptions()
+    {
+      bool changed = false;
+      zmq::message_t event;
+      while( _socket.recv(&event, ZMQ_DONTWAIT) ) {
+        const char* data = static_cast<const char*>(event.data());
+        if( event.size() == 0 ) {
+          continue;
+        }
+        string prefix(data + 1, event.size() - 1);
+        if( data[0] == 1 ) {
+          changed |= _topics.insert(prefix).second;
+        }
+        else if( data[0] == 0 ) {
+          changed |= (_topics.erase(prefix) > 0);
+        }
+      }
+      if( changed ) {
+        std::atomic_store(&_published_topics, std::make_shared<const std::set<string>>(_topics));
+      }
+    }
+
+    void poll_consumers()
+    {
+      const auto now = fc::time_point::now();
+      zmq::message_t identity;
+      while( _socket.recv(&identity, ZMQ_DONTWAIT) ) {
+        // the request is the last frame
+        zmq::message_t request;
+        while( _socket.getsockopt<int>(ZMQ_RCVMORE) ) {
+          _socket.recv(&request);
+        }
+        string id((const char*) identity.data(), identity.size());
+        auto& c = _consumers[id];
+        c.last_seen = now;
+        try {
+          const auto req = fc::json::from_string(string((const char*) request.data(), request.size())).get_object();
+          if( req.contains("credit") ) {
+            c.credit += req["credit"].as<uint64_t>();
+          }
+          if( req.contains("ack") ) {
+            const uint64_t ack = req["ack"].as<uint64_t>();
+            auto it = std::find_if(c.in_flight.begin(), c.in_flight.end(),
+                                   [&](const delivery& d) { return d.id == ack; });
+            if( it != c.in_flight.end() ) {
+              c.in_flight.erase(c.in_flight.begin(), it + 1);
+            }
+          }
+        }
+        catch( const fc::exception& e ) {
+          wlog("Invalid request from ZMQ consumer: ${e}", ("e", e.to_string()));
+        }
+        catch( const std::exception& e ) {
+          wlog("Invalid request from ZMQ consumer: ${e}", ("e", e.what()));
+        }
+      }
+
+      // A silent consumer keeps its credits: with a filtered or quiet
+      // stream, it may be waiting for messages. It is only dropped when
+      // the socket reports it as disconnected.
+      for( auto& c : _consumers ) {
+        if( !c.second.in_flight.empty() && now - c.second.last_seen > _opts.router_timeout ) {
+          ilog("ZMQ consumer timed out on ${e}, ${n} messages to be redelivered",
+               ("e", _endpoint)("n", c.second.in_flight.size()));
+          requeue(c.second);
+        }
+      }
+    }
+
+    // unacknowledged messages go back to the front of the pending queue
+    void requeue(consumer& c)
+    {
+      for( auto d = c.in_flight.rbegin(); d != c.in_flight.rend(); ++d ) {
+        _pending.emplace_front(std::move(*d));
+      }
+      c.in_flight.clear();
+    }
+
+    std::map<string, consumer>::iterator drop_consumer(std::map<string, consumer>::iterator it)
+    {
+      requeue(it->second);
+      return _consumers.erase(it);
+    }
+
+    enum class delivery_result { sent, busy, gone };
+
+    // sends pending messages to the consumers with credits, round-robin
+    void dispatch()
+    {
+      while( !_pending.empty() ) {
+        auto it = next_consumer();
+        if( it == _consumers.end() ) {
+          return;
+        }
+        const auto result = deliver(it);
+        if( result == delivery_result::busy ) {
+          return;
+        }
+        if( result == delivery_result::gone ) {
+          ilog("ZMQ consumer disconnected from ${e}, ${n} messages to be redelivered",
+               ("e", _endpoint)("n", it->second.in_flight.size()));
+          drop_consumer(it);
+        }
+      }
+    }
+
+    std::map<string, consumer>::iterator next_consumer()
+    {
+      auto it = _consumers.upper_bound(_last_served);
+      for( size_t n = 0; n < _consumers.size(); ++n, ++it ) {
+        if( it == _consumers.end() ) {
+          it = _consumers.begin();
+        }
+        if( it->second.credit > 0 ) {
+          return it;
+        }
+      }
+      return _consumers.end();
+    }
+
+    delivery_result deliver(std::map<string, consumer>::iterator it)
+    {
+      auto& d = _pending.front();
+      try {
+        zmq::message_t identity(it->first.size());
+        memcpy(identity.data(), it->first.data(), it->first.size());
+        if( !_socket.send(identity, ZMQ_SNDMORE | ZMQ_DONTWAIT) ) {
+          return delivery_result::busy;  // high water mark reached, retry on next poll
+        }
+        zmq::message_t id_frame(sizeof(d.id));
+        memcpy(id_frame.data(), &d.id, sizeof(d.id));
+        _socket.send(id_frame, ZMQ_SNDMORE);
+        zmq::message_t copy;
+        copy.copy(&d.msg);
+        _socket.send(copy);
+      }
+      catch( const zmq::error_t& e ) {
+        if( e.num() == EHOSTUNREACH ) {
+          return delivery_result::gone;
+        }
+        throw;
+      }
+      _last_served = it->first;
+      --it->second.credit;
+      it->second.in_flight.emplace_back(std::move(d));
+      _pending.pop_front();
+      return delivery_result::sent;
+    }
+
+    zmq::socket_t                             _socket;
+    string                                    _endpoint;
+    sender_options                            _opts;
+    std::set<string>                          _topics;
+    std::shared_ptr<const std::set<string>>   _published_topics;
+    std::map<string, consumer>                _consumers;
+    string                                    _last_served;
+    std::deque<delivery>                      _pending;
+    uint64_t                                  _next_delivery_id = 1;
+  };
+
+  // Compresses the data part of outgoing messages on the sender thread.
+  // LZ4 output is the 32-bit uncompressed size in host native format
+  // followed by an LZ4 block. Zstd output is a standard zstd frame, which
+  // refers to the dictionary ID if a dictionary is used.
+  class message_compressor {
+  public:
+    enum class algorithm { lz4, zstd };
+
+    message_compressor(algorithm algo, int level, const string& dictionary):
+      _algo(algo),
+      _level(level)
+    {
+      if( _algo == algorithm::zstd ) {
+#ifdef ZMQ_PLUGIN_HAVE_ZSTD
+        if( _level == 0 ) {
+          _level = ZSTD_CLEVEL_DEFAULT;
+        }
+        _cctx = ZSTD_createCCtx();
+        if( !dictionary.empty() ) {
+          _cdict = ZSTD_createCDict(dictionary.data(), dictionary.size(), _level);
+          EOS_ASSERT( _cdict != nullptr, plugin_config_exception, "Invalid zstd dictionary" );
+        }
+#else
+        EOS_ASSERT( false, plugin_config_exception, "zmq_plugin is compiled without zstd support" );
+#endif
+      }
+      else {
+#ifndef ZMQ_PLUGIN_HAVE_LZ4
+        EOS_ASSERT( false, plugin_config_exception, "zmq_plugin is compiled without lz4 support" );
+#endif
+        EOS_ASSERT( dictionary.empty(), plugin_config_exception, "Dictionaries are only supported with zstd" );
+      }
+    }
+
+    ~message_compressor()
+    {
+#ifdef ZMQ_PLUGIN_HAVE_ZSTD
+      if( _cdict != nullptr ) ZSTD_freeCDict(_cdict);
+      if( _cctx != nullptr ) ZSTD_freeCCtx(_cctx);
+#endif
+    }
+
+    // Compresses the data following the header in src into dst, after the
+    // header already present there. Returns the msgopts flag to set, or 0
+    // if the message was not worth compressing.
+    int32_t compress(const string& src, string& dst)
+    {
+      const size_t hdr = buffer_pool::HEADER_SIZE;
+      const char* data = src.data() + hdr;
+      const size_t size = src.size() - hdr;
+      size_t out_size = 0;
+      int32_t flag = 0;
+
+      if( _algo == algorithm::zstd ) {
+#ifdef ZMQ_PLUGIN_HAVE_ZSTD
+        dst.resize(hdr + ZSTD_compressBound(size));
+        size_t rc = (_cdict != nullptr) ?
+          ZSTD_compress_usingCDict(_cctx, &dst[hdr], dst.size() - hdr, data, size, _cdict) :
+          ZSTD_compressCCtx(_cctx, &dst[hdr], dst.size() - hdr, data, size, _level);
+        if( ZSTD_isError(rc) ) {
+          return 0;
+        }
+        out_size = rc;
+        flag = MSGOPT_ZSTD;
+#endif
+      }
+      else {
+#ifdef ZMQ_PLUGIN_HAVE_LZ4
+        if( size > uint32_t(LZ4_MAX_INPUT_SIZE) ) {
+          return 0;
+        }
+        const uint32_t orig_size = size;
+        dst.resize(hdr + sizeof(orig_size) + LZ4_compressBound(size));
+        memcpy(&dst[hdr], &orig_size, sizeof(orig_size));
+        char* out = &dst[hdr + sizeof(orig_size)];
+        const int cap = dst.size() - hdr - sizeof(orig_size);
+        int rc = (_level > 0) ?
+          LZ4_compress_HC(data, out, size, cap, _level) :
+          LZ4_compress_default(data, out, size, cap);
+        if( rc <= 0 ) {
+          return 0;
+        }
+        out_size = sizeof(orig_size) + rc;
+        flag = MSGOPT_LZ4;
+#endif
+      }
+
+      if( out_size >= size ) {
+        return 0;
+      }
+      dst.resize(hdr + out_size);
+      return flag;
+    }
+
+  private:
+    algorithm          _algo;
+    int                _level;
+#ifdef ZMQ_PLUGIN_HAVE_ZSTD
+    ZSTD_CCtx*         _cctx = nullptr;
+    ZSTD_CDict*        _cdict = nullptr;
+#endif
+  };
+
+  // Journal of sent messages, stored in memory-mapped segment files. Each
+  // record is a journal_record_header followed by the message as it was
+  // sent, padded to 8 bytes. A zero size marks the end of the written part
+  // of a segment. Records are numbered with a continuous journal index.
+  struct journal_record_header {
+    uint32_t                     size;
+    block_num_type               block_num;
+    uint64_t                     index;
+    uint64_t                     global_action_seq;
+    int32_t                      shard;
+    uint32_t                     reserved;
+  };
+
+  class message_journal {
+  public:
+    struct record {
+      const journal_record_header*  header;
+      const char*                   data;
+    };
+
+    ~message_journal()
+    {
+      flush();
+    }
+
+    void open(const boost::filesystem::path& dir, uint64_t segment_size)
+    {
+      std::lock_guard<std::mutex> lock(_mtx);
+      _dir = dir;
+      _segment_size = segment_size;
+      boost::filesystem::create_directories(_dir);
+
+      std::vector<boost::filesystem::path> files;
+      for( boost::filesystem::directory_iterator it(_dir), end; it != end; ++it ) {
+        if( it->path().extension() == ".log" && it->path().filename().string().find("journal-") == 0 ) {
+          files.push_back(it->path());
+        }
+      }
+      // file names contain the zero-padded first index
+      std::sort(files.begin(), files.end());
+
+      for( const auto& f : files ) {
+        _segments.emplace_back(map_segment(f));
+        scan_segment(*_segments.back());
+        if( _segments.back()->offsets.empty() ) {
+          _segments.back()->first_index = _next_index;
+        }
+        else if( _segments.size() > 1 &&
+                 _segments.back()->first_index != _next_index ) {
+          wlog("ZMQ journal has a gap before ${f}", ("f", f.string()));
+        }
+        _next_index = _segments.back()->first_index + _segments.back()->offsets.size();
+      }
+
+      ilog("ZMQ journal opened in ${d}, ${n} segments, next index ${i}",
+           ("d", _dir.string())("n", _segments.size())("i", _next_index));
+    }
+
+    void append(block_num_type block_num, uint64_t global_action_seq, int32_t shard, const char* data, size_t size)
+    {
+      const uint64_t needed = record_size(size) + sizeof(journal_record_header);
+      std::lock_guard<std::mutex> lock(_mtx);
+      if( _segments.empty() || _segments.back()->write_pos + needed > _segments.back()->capacity ) {
+        add_segment(std::max<uint64_t>(_segment_size, needed));
+      }
+
+      auto& seg = *_segments.back();
+      char* base = static_cast<char*>(seg.region->get_address()) + seg.write_pos;
+      memcpy(base + sizeof(journal_record_header), data, size);
+
+      journal_record_header hdr{0, block_num, _next_index, global_action_seq, shard, 0};
+      memcpy(base, &hdr, sizeof(hdr));
+      // the size is written last, so that an interrupted write leaves the record invisible
+      const uint32_t sz = static_cast<uint32_t>(size);
+      std::atomic_thread_fence(std::memory_order_release);
+      memcpy(base, &sz, sizeof(sz));
+
+      seg.offsets.push_back(seg.write_pos);
+      seg.write_pos += record_size(size);
+      seg.min_block = seg.offsets.size() == 1 ? block_num : std::min(seg.min_block, block_num);
+      seg.max_block = std::max(seg.max_block, block_num);
+      ++_next_index;
+    }
+
+    // Deletes the segments that only contain blocks below keep_from_block.
+    // The segment being written is always kept.
+    void trim(block_num_type keep_from_block)
+    {
+      std::lock_guard<std::mutex> lock(_mtx);
+      while( _segments.size() > 1 && _segments.front()->max_block < keep_from_block ) {
+        auto path = _segments.front()->path;
+        _segments.pop_front();
+        boost::system::error_code ec;
+        boost::filesystem::remove(path, ec);
+        if( ec ) {
+          wlog("Cannot remove ZMQ journal segment ${f}: ${e}", ("f", path.string())("e", ec.message()));
+        }
+      }
+    }
+
+    void flush()
+    {
+      std::lock_guard<std::mutex> lock(_mtx);
+      if( !_segments.empty() ) {
+        _segments.back()->region->flush(0, 0, true);
+      }
+    }
+
+    uint64_t next_index() const
+    {
+      std::lock_guard<std::mutex> lock(_mtx);
+      return _next_index;
+    }
+
+    uint64_t first_index() const
+    {
+      std::lock_guard<std::mutex> lock(_mtx);
+      return _segments.empty() ? _next_index : _segments.front()->first_index;
+    }
+
+    // index of the first record with block_num at or above the given one
+    uint64_t find_block(block_num_type block_num) const
+    {
+      std::lock_guard<std::mutex> lock(_mtx);
+      for( const auto& seg : _segments ) {
+        if( seg->offsets.empty() || seg->max_block < block_num ) {
+          continue;
+        }
+        for( size_t i = 0; i < seg->offsets.size(); ++i ) {
+          if( header_at(*seg, i)->block_num >= block_num ) {
+            return seg->first_index + i;
+          }
+        }
+      }
+      return _next_index;
+    }
+
+    // index of the record following the action trace with the given sequence
+    uint64_t find_after_action(uint64_t global_action_seq) const
+    {
+      std::lock_guard<std::mutex> lock(_mtx);
+      for( auto s = _segments.rbegin(); s != _segments.rend(); ++s ) {
+        const auto& seg = **s;
+        for( size_t i = seg.offsets.size(); i > 0; --i ) {
+          if( header_at(seg, i-1)->global_action_seq == global_action_seq ) {
+            return seg.first_index + i;
+          }
+        }
+      }
+      return _next_index;
+    }
+
+    // Calls fn(record) for the records starting at from_index, until it
+    // returns true for max_records of them. Returns the index following the
+    // last record read.
+    template<typename F>
+    uint64_t read(uint64_t from_index, size_t max_records, F&& fn) const
+    {
+      std::lock_guard<std::mutex> lock(_mtx);
+      uint64_t index = from_index;
+      for( const auto& seg : _segments ) {
+        if( max_records == 0 ) {
+          break;
+        }
+        const uint64_t seg_end = seg->first_index + seg->offsets.size();
+        if( index >= seg_end ) {
+          continue;
+        }
+        index = std::max(index, seg->first_index);
+        for( ; index < seg_end && max_records > 0; ++index ) {
+          const auto* hdr = header_at(*seg, index - seg->first_index);
+          if( fn(record{hdr, reinterpret_cast<const char*>(hdr) + sizeof(journal_record_header)}) ) {
+            --max_records;
+          }
+        }
+      }
+      return index;
+    }
+
+  private:
+    struct segment {
+      boost::filesystem::path                                path;
+      uint64_t                                               first_index = 0;
+      uint64_t                                               capacity = 0;
+      uint64_t                                               write_pos = 0;
+      block_num_type                                         min_block = 0;
+      block_num_type                                         max_block = 0;
+      std::vector<uint64_t>                                  offsets;
+      std::unique_ptr<boost::interprocess::file_mapping>     file;
+      std::unique_ptr<boost::interprocess::mapped_region>    region;
+    };
+
+    static uint64_t record_size(size_t size)
+    {
+      return (sizeof(journal_record_header) + size + 7) & ~uint64_t(7);
+    }
+
+    static const journal_record_header* header_at(const segment& seg, size_t i)
+    {
+      return reinterpret_cast<const journal_record_header*>
+        (static_cast<const char*>(seg.region->get_address()) + seg.offsets[i]);
+    }
+
+    static std::unique_ptr<segment> map_segment(const boost::filesystem::path& path)
+    {
+      std::unique_ptr<segment> seg(new segment());
+      seg->path = path;
+      seg->capacity = boost::filesystem::file_size(path);
+      seg->file.reset(new boost::interprocess::file_mapping(path.string().c_str(), boost::interprocess::read_write));
+      seg->region.reset(new boost::interprocess::mapped_region(*seg->file, boost::interprocess::read_write));
+      return seg;
+    }
+
+    void scan_segment(segment& seg)
+    {
+      const char* base = static_cast<const char*>(seg.region->get_address());
+      while( seg.write_pos + sizeof(journal_record_header) <= seg.capacity ) {
+        journal_record_header hdr;
+        memcpy(&hdr, base + seg.write_pos, sizeof(hdr));
+        if( hdr.size == 0 || seg.write_pos + record_size(hdr.size) > seg.capacity ) {
+          break;
+        }
+        if( seg.offsets.empty() ) {
+          seg.first_index = hdr.index;
+          seg.min_block = hdr.block_num;
+        }
+        seg.min_block = std::min(seg.min_block, hdr.block_num);
+        seg.max_block = std::max(seg.max_block, hdr.block_num);
+        seg.offsets.push_back(seg.write_pos);
+        seg.write_pos += record_size(hdr.size);
+      }
+    }
+
+    void add_segment(uint64_t capacity)
+    {
+      if( !_segments.empty() ) {
+        _segments.back()->region->flush(0, 0, true);
+      }
+
+      char name[64];
+      snprintf(name, sizeof(name), "journal-%020llu.log", (unsigned long long) _next_index);
+      auto path = _dir / name;
+      {
+        // the file is created filled with zeros
+        std::filebuf fbuf;
+        fbuf.open(path.string().c_str(), std::ios_base::in | std::ios_base::out |
+                  std::ios_base::trunc | std::ios_base::binary);
+        fbuf.pubseekoff(capacity - 1, std::ios_base::beg);
+        fbuf.sputc(0);
+      }
+      _segments.emplace_back(map_segment(path));
+      _segments.back()->first_index = _next_index;
+    }
+
+    boost::filesystem::path                  _dir;
+    uint64_t                                 _segment_size = 0;
+    uint64_t                                 _next_index = 0;
+    std::deque<std::unique_ptr<segment>>     _segments;
+    mutable std::mutex                       _mtx;
+  };
+
+  // A message of the block being processed. Action traces are serialized
+  // after all chain state lookups are done.
+  struct block_item {
+    int32_t                      msgtype = MSGTYPE_ACTION_TRACE;
+    const action_trace*          trace = nullptr;
+    zmq_action_object            zao;
+    buffer_ptr                   msg;      // output in individual messages mode
+    string                       content;  // output in batch mode
+
+    int32_t                      shard = -1;
+    string                       topic;
+    fc::microseconds             serialize_time;
+
+    string& output() { return msg ? msg->data : content; }
+  };
+
+  // Latency histogram with power-of-two buckets in microseconds. It is
+  // updated by one thread and read by the HTTP thread.
+  class latency_histogram {
+  public:
+    static constexpr size_t BUCKETS = 26;  // up to 2^25 us, about 33 seconds
+
+    latency_histogram()
+    {
+      for( auto& c : _counts ) {
+        c = 0;
+      }
+    }
+
+    void add(fc::microseconds elapsed)
+    {
+      const uint64_t us = std::max<int64_t>(elapsed.count(), 0);
+      size_t b = 0;
+      while( b < BUCKETS - 1 && us >= (uint64_t(1) << b) ) {
+        ++b;
+      }
+      _counts[b].fetch_add(1, std::memory_order_relaxed);
+      _sum_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    fc::mutable_variant_object to_variant() const
+    {
+      uint64_t count = 0;
+      vector<uint64_t> buckets;
+      for( const auto& c : _counts ) {
+        buckets.push_back(c.load(std::memory_order_relaxed));
+        count += buckets.back();
+      }
+      // trailing empty buckets are not reported
+      while( !buckets.empty() && buckets.back() == 0 ) {
+        buckets.pop_back();
+      }
+      return fc::mutable_variant_object()
+        ("count", count)
+        ("sum_us", _sum_us.load(std::memory_order_relaxed))
+        ("buckets_le_pow2_us", buckets);
+    }
+
+    void to_prometheus(const string& metric, const string& labels, string& out) const
+    {
+      const string sep = labels.empty() ? "" : ",";
+      uint64_t cumulative = 0;
+      for( size_t b = 0; b < BUCKETS; ++b ) {
+        cumulative += _counts[b].load(std::memory_order_relaxed);
+        const string le = (b == BUCKETS - 1) ? "+Inf" : fc::to_string(double(uint64_t(1) << b) / 1e6);
+        out += metric + "_bucket{" + labels + sep + "le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+      }
+      const string braces = labels.empty() ? "" : "{" + labels + "}";
+      out += metric + "_sum" + braces + " " +
+        fc::to_string(double(_sum_us.load(std::memory_order_relaxed)) / 1e6) + "\n";
+      out += metric + "_count" + braces + " " + std::to_string(cumulative) + "\n";
+    }
+
+  private:
+    std::atomic<uint64_t>  _counts[BUCKETS];
+    std::atomic<uint64_t>  _sum_us{0};
+  };
+
+  // Pipeline instrumentation, exposed by the HTTP API
+  struct plugin_metrics {
+    static constexpr size_t MSGTYPES = 16;
+    // contracts exported to Prometheus, by action count; JSON has them all
+    static constexpr size_t PROMETHEUS_CONTRACTS = 50;
+
+    plugin_metrics()
+    {
+      for( size_t i = 0; i < MSGTYPES; ++i ) {
+        messages_sent[i] = 0;
+        bytes_sent[i] = 0;
+      }
+    }
+
+    // chain thread
+    latency_histogram        accepted_block;    // whole on_accepted_block
+    latency_histogram        prepare_actions;   // filters, accounts and balance lookups, per block
+    latency_histogram        serialize_actions; // ABI decoding and encoding, per block
+    latency_histogram        enqueue_wait;      // producer blocked on a full queue, per message
+    latency_histogram        columnar_encode;   // Arrow batch encoding, per flush
+    std::atomic<uint64_t>    blocks{0};
+    std::atomic<uint64_t>    dropped_messages{0};
+    std::atomic<uint64_t>    spilled_messages{0};
+    std::atomic<uint64_t>    trace_cache_size{0};
+    std::atomic<uint64_t>    trace_cache_bytes{0};
+    std::atomic<uint64_t>    trace_cache_hits{0};
+    std::atomic<uint64_t>    trace_cache_misses{0};
+    std::atomic<uint64_t>    trace_cache_evictions{0};
+
+    // sender thread
+    latency_histogram        compress;          // per message
+    latency_histogram        socket_send;       // time blocked sending, per message
+    std::atomic<uint64_t>    messages_sent[MSGTYPES];
+    std::atomic<uint64_t>    bytes_sent[MSGTYPES];
+
+    // serialization cost per contract, aggregated once per block
+    struct contract_cost {
+      uint64_t               actions = 0;
+      uint64_t               time_us = 0;
+    };
+
+    void add_contract_costs(const std::unordered_map<uint64_t, contract_cost>& block_costs)
+    {
+      std::lock_guard<std::mutex> lock(_contracts_mtx);
+      for( const auto& c : block_costs ) {
+        auto& total = _contracts[c.first];
+        total.actions += c.second.actions;
+        total.time_us += c.second.time_us;
+      }
+    }
+
+    void count_sent(int32_t msgtype, size_t bytes)
+    {
+      if( msgtype >= 0 && size_t(msgtype) < MSGTYPES ) {
+        messages_sent[msgtype].fetch_add(1, std::memory_order_relaxed);
+        bytes_sent[msgtype].fetch_add(bytes, std::memory_order_relaxed);
+      }
+    }
+
+    fc::variant to_variant(uint64_t queue_size) const
+    {
+      fc::mutable_variant_object msgtypes;
+      for( size_t i = 0; i < MSGTYPES; ++i ) {
+        const uint64_t n = messages_sent[i].load(std::memory_order_relaxed);
+        if( n > 0 ) {
+          msgtypes(std::to_string(i), fc::mutable_variant_object()
+                   ("messages", n)
+                   ("bytes", bytes_sent[i].load(std::memory_order_relaxed)));
+        }
+      }
+      fc::mutable_variant_object contracts;
+      {
+        std::lock_guard<std::mutex> lock(_contracts_mtx);
+        for( const auto& c : _contracts ) {
+          contracts(name(c.first).to_string(), fc::mutable_variant_object()
+                    ("actions", c.second.actions)
+                    ("serialize_us", c.second.time_us));
+        }
+      }
+      return fc::mutable_variant_object()
+        ("blocks", blocks.load())
+        ("queue_size", queue_size)
+        ("dropped_messages", dropped_messages.load())
+        ("spilled_messages", spilled_messages.load())
+        ("trace_cache", fc::mutable_variant_object()
+         ("size", trace_cache_size.load())
+         ("bytes", trace_cache_bytes.load())
+         ("hits", trace_cache_hits.load())
+         ("misses", trace_cache_misses.load())
+         ("evictions", trace_cache_evictions.load()))
+        ("latency", fc::mutable_variant_object()
+         ("accepted_block", accepted_block.to_variant())
+         ("prepare_actions", prepare_actions.to_variant())
+         ("serialize_actions", serialize_actions.to_variant())
+         ("enqueue_wait", enqueue_wait.to_variant())
+         ("columnar_encode", columnar_encode.to_variant())
+         ("compress", compress.to_variant())
+         ("socket_send", socket_send.to_variant()))
+        ("msgtypes", msgtypes)
+        ("contracts", contracts);
+    }
+
+    // Prometheus text exposition format
+    string to_prometheus(uint64_t queue_size) const
+    {
+      string out;
+      auto value = [&](const char* metric, const char* type, uint64_t v) {
+        out += string("# TYPE ") + metric + " " + type + "\n" + metric + " " + std::to_string(v) + "\n";
+      };
+      value("zmq_plugin_blocks_total", "counter", blocks.load());
+      value("zmq_plugin_queue_size", "gauge", queue_size);
+      value("zmq_plugin_dropped_messages_total", "counter", dropped_messages.load());
+      value("zmq_plugin_spilled_messages_total", "counter", spilled_messages.load());
+      value("zmq_plugin_trace_cache_size", "gauge", trace_cache_size.load());
+      value("zmq_plugin_trace_cache_bytes", "gauge", trace_cache_bytes.load());
+      value("zmq_plugin_trace_cache_hits_total", "counter", trace_cache_hits.load());
+      value("zmq_plugin_trace_cache_misses_total", "counter", trace_cache_misses.load());
+      value("zmq_plugin_trace_cache_evictions_total", "counter", trace_cache_evictions.load());
+
+      out += "# TYPE zmq_plugin_stage_seconds histogram\n";
+      accepted_block.to_prometheus("zmq_plugin_stage_seconds", "stage=\"accepted_block\"", out);
+      prepare_actions.to_prometheus("zmq_plugin_stage_seconds", "stage=\"prepare_actions\"", out);
+      serialize_actions.to_prometheus("zmq_plugin_stage_seconds", "stage=\"serialize_actions\"", out);
+      enqueue_wait.to_prometheus("zmq_plugin_stage_seconds", "stage=\"enqueue_wait\"", out);
+      columnar_encode.to_prometheus("zmq_plugin_stage_seconds", "stage=\"columnar_encode\"", out);
+      compress.to_prometheus("zmq_plugin_stage_seconds", "stage=\"compress\"", out);
+      socket_send.to_prometheus("zmq_plugin_stage_seconds", "stage=\"socket_send\"", out);
+
+      out += "# TYPE zmq_plugin_messages_total counter\n";
+      for( size_t i = 0; i < MSGTYPES; ++i ) {
+        if( messages_sent[i].load() > 0 ) {
+          out += "zmq_plugin_messages_total{msgtype=\"" + std::to_string(i) + "\"} " +
+            std::to_string(messages_sent[i].load()) + "\n";
+        }
+      }
+      out += "# TYPE zmq_plugin_bytes_total counter\n";
+      for( size_t i = 0; i < MSGTYPES; ++i ) {
+        if( messages_sent[i].load() > 0 ) {
+          out += "zmq_plugin_bytes_total{msgtype=\"" + std::to_string(i) + "\"} " +
+            std::to_string(bytes_sent[i].load()) + "\n";
+        }
+      }
+
+      // label cardinality stays bounded however many contracts are seen
+      vector<std::pair<uint64_t, contract_cost>> top;
+      {
+        std::lock_guard<std::mutex> lock(_contracts_mtx);
+        top.assign(_contracts.begin(), _contracts.end());
+      }
+      const auto by_actions = [](const std::pair<uint64_t, contract_cost>& a,
+                                 const std::pair<uint64_t, contract_cost>& b) {
+        return a.second.actions > b.second.actions;
+      };
+      if( top.size() > PROMETHEUS_CONTRACTS ) {
+        std::partial_sort(top.begin(), top.begin() + PROMETHEUS_CONTRACTS, top.end(), by_actions);
+        top.resize(PROMETHEUS_CONTRACTS);
+      }
+      out += "# TYPE zmq_plugin_contract_actions_total counter\n";
+      for( const auto& c : top ) {
+        out += "zmq_plugin_contract_actions_total{contract=\"" + name(c.first).to_string() + "\"} " +
+          std::to_string(c.second.actions) + "\n";
+      }
+      out += "# TYPE zmq_plugin_contract_serialize_seconds_total counter\n";
+      for( const auto& c : top ) {
+        out += "zmq_plugin_contract_serialize_seconds_total{contract=\"" + name(c.first).to_string() + "\"} " +
+          fc::to_string(double(c.second.time_us) / 1e6) + "\n";
+      }
+      return out;
+    }
+
+  private:
+    mutable std::mutex                              _contracts_mtx;
+    std::map<uint64_t, contract_cost>               _contracts;
+  };
+
+  // Fixed set of worker threads running parallel loops on behalf of the
+  // chain thread, which takes part in the loop as well.
+  class worker_pool {
+  public:
+    explicit worker_pool(size_t threads)
+    {
+      for( size_t i = 0; i < threads; ++i ) {
+        _threads.emplace_back([this]{ worker_loop(); });
+      }
+    }
+
+    ~worker_pool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _stop = true;
+      }
+      _cv.notify_all();
+      for( auto& t : _threads ) {
+        t.join();
+      }
+    }
+
+    // Calls fn(i) for every i in [0, count) and returns when all calls are
+    // finished. The first exception thrown by fn is rethrown here.
+    void parallel_for(size_t count, const std::function<void(size_t)>& fn)
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _fn = &fn;
+        _count = count;
+        _next = 0;
+        _active = _threads.size();
+        _error = nullptr;
+        ++_generation;
+      }
+      _cv.notify_all();
+
+      run();
+
+      std::unique_lock<std::mutex> lock(_mtx);
+      _done_cv.wait(lock, [&]{ return _active == 0; });
+      _fn = nullptr;
+      if( _error ) {
+        std::rethrow_exception(_error);
+      }
+    }
+
+  private:
+    void run()
+    {
+      size_t i;
+      while( (i = _next++) < _count ) {
+        try {
+          (*_fn)(i);
+        }
+        catch( ... ) {
+          std::lock_guard<std::mutex> lock(_mtx);
+          if( !_error ) {
+            _error = std::current_exception();
+          }
+        }
+      }
+    }
+
+    void worker_loop()
+    {
+      uint64_t seen = 0;
+      while( true ) {
+        {
+          std::unique_lock<std::mutex> lock(_mtx);
+          _cv.wait(lock, [&]{ return _stop || _generation != seen; });
+          if( _stop ) {
+            return;
+          }
+          seen = _generation;
+        }
+        run();
+        {
+          std::lock_guard<std::mutex> lock(_mtx);
+          --_active;
+        }
+        _done_cv.notify_all();
+      }
+    }
+
+    std::vector<std::thread>                 _threads;
+    std::mutex                               _mtx;
+    std::condition_variable                  _cv;
+    std::condition_variable                  _done_cv;
+    const std::function<void(size_t)>*       _fn = nullptr;
+    size_t                                   _count = 0;
+    std::atomic<size_t>                      _next{0};
+    size_t                                   _active = 0;
+    uint64_t                                 _generation = 0;
+    std::exception_ptr                       _error;
+    bool                                     _stop = false;
+  };
+
+  // Handle to a cached abi_serializer, returned by the ABI resolver
+  // instead of a copy of the serializer
+  struct abi_serializer_ref {
+    std::shared_ptr<const abi_serializer> ptr;
+
+    bool valid() const { return ptr != nullptr; }
+    const abi_serializer* operator->() const { return ptr.get(); }
+    const abi_serializer& operator*() const { return *ptr; }
+  };
+
+  // LRU cache of constructed ABI serializers, keyed by account. An entry is
+  // valid as long as the account's abi_sequence stays the same.
+  class abi_cache {
+  public:
+    explicit abi_cache(size_t capacity = 0):
+      _capacity(capacity)
+    {}
+
+    void set_capacity(size_t capacity)
+    {
+      _capacity = capacity;
+      while( _entries.size() > _capacity ) {
+        _entries.erase(_lru.back());
+        _lru.pop_back();
+      }
+    }
+
+    bool find(name account, uint64_t abi_sequence, abi_serializer_ref& result)
+    {
+      auto it = _entries.find(account.value);
+      if( it == _entries.end() || it->second.abi_sequence != abi_sequence ) {
+        return false;
+      }
+      _lru.splice(_lru.begin(), _lru, it->second.lru_pos);
+      result.ptr = it->second.serializer;
+      return true;
+    }
+
+    void insert(name account, uint64_t abi_sequence, const abi_serializer_ref& ref)
+    {
+      if( _capacity == 0 ) {
+        return;
+      }
+      erase(account);
+      if( _entries.size() >= _capacity ) {
+        _entries.erase(_lru.back());
+        _lru.pop_back();
+      }
+      _lru.push_front(account.value);
+      _entries[account.value] = entry{abi_sequence, ref.ptr, _lru.begin()};
+    }
+
+    void erase(name account)
+    {
+      auto it = _entries.find(account.value);
+      if( it != _entries.end() ) {
+        _lru.erase(it->second.lru_pos);
+        _entries.erase(it);
+      }
+    }
+
+  private:
+    struct entry {
+      uint64_t                               abi_sequence;
+      std::shared_ptr<const abi_serializer>  serializer;
+      std::list<uint64_t>::iterator          lru_pos;
+    };
+
+    size_t                                 _capacity;
+    std::unordered_map<uint64_t, entry>    _entries;
+    std::list<uint64_t>                    _lru;
+  };
+
+  // Writes JSON directly into the output string, byte-identical to
+  // fc::json::to_string() of the variant that fc::to_variant() or
+  // abi_serializer::to_variant() would produce. Values whose formatting has
+  // edge cases (large or negative numbers, non-ASCII strings, time points,
+  // keys, floats) go through a variant of that value only, and action data
+  // that the ABI walk does not handle goes through binary_to_variant().
+  class json_writer {
+  public:
+    explicit json_writer(string& out): _out(out) {}
+
+    template<typename Resolver>
+    void action_object(const zmq_action_object& zao, const action_trace& at,
+                       Resolver& resolver, const fc::microseconds& max_time)
+    {
+      _deadline = fc::time_point::now() + max_time;
+      bool first = true;
+      _out.push_back('{');
+      key("global_action_seq", first);
+      value(zao.global_action_seq);
+      key("block_num", first);
+      value(zao.block_num);
+      key("block_time", first);
+      value(zao.block_time);
+      key("action_trace", first);
+      trace_value(at, resolver);
+      key("resource_balances", first);
+      value(zao.resource_balances);
+      key("currency_balances", first);
+      value(zao.currency_balances);
+      key("last_irreversible_block", first);
+      value(zao.last_irreversible_block);
+      if( zao.schemas ) {
+        key("schemas", first);
+        value(*zao.schemas);
+      }
+      _out.push_back('}');
+    }
+
+    // scalars
+
+    void value(bool v) { _out.append(v ? "true" : "false"); }
+
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type
+    value(T v)
+    {
+      // fc quotes integers above 32 bits
+      if( v >= 0 && uint64_t(v) < 0xffffffffULL ) {
+        append_uint(uint64_t(v));
+      }
+      else {
+        fallback(v);
+      }
+    }
+
+    void value(const fc::unsigned_int& v) { value(v.value); }
+    void value(const fc::microseconds& v) { value(v.count()); }
+    void value(const name& v) { raw_string(v.to_string()); }
+    void value(const asset& v) { raw_string(v.to_string()); }
+    void value(const fc::sha256& v) { hex_string(v.data(), v.data_size()); }
+    void value(const fc::ripemd160& v) { hex_string(v.data(), v.data_size()); }
+    void value(const fc::sha512& v) { hex_string(v.data(), v.data_size()); }
+    void value(const bytes& v) { hex_string(v.data(), v.size()); }
+
+    void value(const string& v)
+    {
+      if( !escape(v.data(), v.size()) ) {
+        fallback(v);
+      }
+    }
+
+    // containers
+
+    template<typename T>
+    void value(const vector<T>& v)
+    {
+      _out.push_back('[');
+      for( size_t i = 0; i < v.size(); ++i ) {
+        if( i > 0 ) {
+          _out.push_back(',');
+        }
+        value(v[i]);
+      }
+      _out.push_back(']');
+    }
+
+    template<typename T>
+    void value(const fc::optional<T>& v)
+    {
+      if( v ) {
+        value(*v);
+      }
+      else {
+        _out.append("null");
+      }
+    }
+
+    // reflected structs with the default conversion, and everything else
+    template<typename T>
+    typename std::enable_if<!std::is_integral<T>::value>::type
+    value(const T& v)
+    {
+      write_other(v, plain_reflected<T>());
+    }
+
+  private:
+    template<typename T> struct plain_reflected : std::false_type {};
+
+    template<typename T>
+    void write_other(const T& v, std::true_type)
+    {
+      bool first = true;
+      _out.push_back('{');
+      fc::reflector<T>::visit(field_visitor<T>(*this, v, first));
+      _out.push_back('}');
+    }
+
+    template<typename T>
+    void write_other(const T& v, std::false_type)
+    {
+      fallback(v);
+    }
+
+    template<typename T>
+    void fallback(const T& v)
+    {
+      _out.append(fc::json::to_string(fc::variant(v)));
+    }
+
+    template<typename T>
+    struct field_visitor {
+      field_visitor(json_writer& w, const T& obj, bool& first): w(w), obj(obj), first(first) {}
+
+      template<typename Member, class Class, Member (Class::*member)>
+      void operator()(const char* name) const
+      {
+        w.key(name, first);
+        w.value(obj.*member);
+      }
+
+      json_writer&  w;
+      const T&      obj;
+      bool&         first;
+    };
+
+    // Action traces are traversed like abi_serializer::to_variant() does:
+    // actions get their data decoded, and inline traces are recursed into.
+    template<typename Resolver>
+    struct trace_visitor {
+      trace_visitor(json_writer& w, const action_trace& obj, Resolver& resolver, bool& first):
+        w(w), obj(obj), resolver(resolver), first(first) {}
+
+      template<typename Member, class Class, Member (Class::*member)>
+      void operator()(const char* name) const
+      {
+        w.key(name, first);
+        add(obj.*member);
+      }
+
+      void add(const action& act) const { w.action_value(act, resolver); }
+
+      void add(const vector<action_trace>& traces) const
+      {
+        w._out.push_back('[');
+        for( size_t i = 0; i < traces.size(); ++i ) {
+          if( i > 0 ) {
+            w._out.push_back(',');
+          }
+          w.trace_value(traces[i], resolver);
+        }
+        w._out.push_back(']');
+      }
+
+      template<typename T>
+      void add(const T& v) const { w.value(v); }
+
+      json_writer&        w;
+      const action_trace& obj;
+      Resolver&           resolver;
+      bool&               first;
+    };
+
+    template<typename Resolver>
+    void trace_value(const action_trace& at, Resolver& resolver)
+    {
+      bool first = true;
+      _out.push_back('{');
+      fc::reflector<action_trace>::visit(trace_visitor<Resolver>(*this, at, resolver, first));
+      _out.push_back('}');
+    }
+
+    template<typename Resolver>
+    void action_value(const action& act, Resolver& resolver)
+    {
+      bool first = true;
+      _out.push_back('{');
+      key("account", first);
+      value(act.account);
+      key("name", first);
+      value(act.name);
+      key("authorization", first);
+      value(act.authorization);
+      key("data", first);
+
+      const auto abi = resolver(act.account);
+      const type_name type = abi.valid() ? abi->get_action_type(act.name) : type_name();
+      if( !type.empty() ) {
+        const size_t mark = _out.size();
+        bool decoded = false;
+        try {
+          fc::datastream<const char*> ds(act.data.data(), act.data.size());
+          decoded = abi_value(*abi, type, ds, 0) && ds.remaining() == 0;
+        }
+        catch( ... ) {
+          decoded = false;
+        }
+        if( !decoded ) {
+          _out.resize(mark);
+          try {
+            // the whole trace shares one deadline, as with abi_serializer::to_variant()
+            const auto remaining = std::max(_deadline - fc::time_point::now(), fc::microseconds(0));
+            _out.append(fc::json::to_string(abi->binary_to_variant(type, act.data, remaining)));
+            decoded = true;
+          }
+          catch( ... ) {
+            _out.resize(mark);
+          }
+        }
+        if( decoded ) {
+          key("hex_data", first);
+        }
+      }
+      value(act.data);
+      _out.push_back('}');
+    }
+
+    enum class abi_leaf {
+      none, boolean, int8, uint8, int16, uint16, int32, uint32, int64, uint64,
+      varint32, varuint32, float32, float64, name, string, bytes,
+      checksum160, checksum256, checksum512, asset, symbol,
+      time_point, time_point_sec, block_timestamp, public_key, signature
+    };
+
+    static abi_leaf leaf_type(const type_name& type)
+    {
+      static const std::unordered_map<string, abi_leaf> leaves = {
+        {"bool", abi_leaf::boolean}, {"int8", abi_leaf::int8}, {"uint8", abi_leaf::uint8},
+        {"int16", abi_leaf::int16}, {"uint16", abi_leaf::uint16},
+        {"int32", abi_leaf::int32}, {"uint32", abi_leaf::uint32},
+        {"int64", abi_leaf::int64}, {"uint64", abi_leaf::uint64},
+        {"varint32", abi_leaf::varint32}, {"varuint32", abi_leaf::varuint32},
+        {"float32", abi_leaf::float32}, {"float64", abi_leaf::float64},
+        {"name", abi_leaf::name}, {"string", abi_leaf::string}, {"bytes", abi_leaf::bytes},
+        {"checksum160", abi_leaf::checksum160}, {"checksum256", abi_leaf::checksum256},
+        {"checksum512", abi_leaf::checksum512}, {"asset", abi_leaf::asset}, {"symbol", abi_leaf::symbol},
+        {"time_point", abi_leaf::time_point}, {"time_point_sec", abi_leaf::time_point_sec},
+        {"block_timestamp_type", abi_leaf::block_timestamp},
+        {"public_key", abi_leaf::public_key}, {"signature", abi_leaf::signature}
+      };
+      auto it = leaves.find(type);
+      return (it != leaves.end()) ? it->second : abi_leaf::none;
+    }
+
+    // Depending on the chain version, ABI bool values are decoded as bool
+    // or as uint8. This is detected once with a real ABI serializer.
+    static abi_leaf bool_representation()
+    {
+      static const abi_leaf representation = []{
+        try {
+          abi_def abi;
+          abi.structs.emplace_back(struct_def{"s", "", {field_def{"b", "bool"}}});
+          abi_serializer ser(abi, fc::seconds(1));
+          const auto v = ser.binary_to_variant("s", bytes{1}, fc::seconds(1));
+          return v["b"].is_bool() ? abi_leaf::boolean : abi_leaf::uint8;
+        }
+        catch( ... ) {
+          return abi_leaf::none;
+        }
+      }();
+      return representation;
+    }
+
+    // Writes the value of an ABI type. Returns false if the type is not
+    // handled here, and the output has to be discarded.
+    bool abi_value(const abi_serializer& abi, const type_name& type, fc::datastream<const char*>& ds, uint32_t depth)
+    {
+      if( depth > MAX_ABI_DEPTH || type.empty() || type.back() == '$' ) {
+        return false;
+      }
+      const type_name rtype = abi.resolve_type(type);
+      const type_name ftype = abi.fundamental_type(rtype);
+      const bool array = abi.is_array(rtype);
+      const bool optional = abi.is_optional(rtype);
+
+      if( abi.is_builtin_type(ftype) ) {
+        abi_leaf leaf = leaf_type(ftype);
+        if( leaf == abi_leaf::boolean ) {
+          leaf = bool_representation();
+        }
+        if( leaf == abi_leaf::none ) {
+          return false;
+        }
+        if( array ) {
+          fc::unsigned_int size;
+          fc::raw::unpack(ds, size);
+          if( size.value > ds.remaining() ) {
+            return false;
+          }
+          _out.push_back('[');
+          for( uint32_t i = 0; i < size.value; ++i ) {
+            if( i > 0 ) {
+              _out.push_back(',');
+            }
+            if( !leaf_value(leaf, ds) ) {
+              return false;
+            }
+          }
+          _out.push_back(']');
+          return true;
+        }
+        if( optional ) {
+          bool present = false;
+          fc::raw::unpack(ds, present);
+          if( !present ) {
+            _out.append("null");
+            return true;
+          }
+        }
+        return leaf_value(leaf, ds);
+      }
+
+      if( array ) {
+        fc::unsigned_int size;
+        fc::raw::unpack(ds, size);
+        if( size.value > ds.remaining() ) {
+          return false;
+        }
+        _out.push_back('[');
+        for( uint32_t i = 0; i < size.value; ++i ) {
+          if( i > 0 ) {
+            _out.push_back(',');
+          }
+          // null array elements are rejected by abi_serializer
+          if( abi.is_optional(abi.resolve_type(ftype)) || !abi_value(abi, ftype, ds, depth + 1) ) {
+            return false;
+          }
+        }
+        _out.push_back(']');
+        return true;
+      }
+
+      if( optional ) {
+        char present = 0;
+        fc::raw::unpack(ds, present);
+        if( !present ) {
+          _out.append("null");
+          return true;
+        }
+        return abi_value(abi, ftype, ds, depth + 1);
+      }
+
+      if( !abi.is_struct(rtype) ) {
+        return false;
+      }
+      // abi_serializer merges the base fields into one object
+      vector<const struct_def*> chain;
+      for( type_name t = rtype; !t.empty(); ) {
+        if( chain.size() > MAX_ABI_DEPTH || !abi.is_struct(t) ) {
+          return false;
+        }
+        chain.push_back(&abi.get_struct(t));
+        t = chain.back()->base.empty() ? type_name() : abi.resolve_type(chain.back()->base);
+      }
+      vector<const string*> keys;
+      for( auto s = chain.rbegin(); s != chain.rend(); ++s ) {
+        for( const auto& field : (*s)->fields ) {
+          for( const auto* k : keys ) {
+            if( *k == field.name ) {
+              return false;  // repeated keys are merged by the variant
+            }
+          }
+          keys.push_back(&field.name);
+        }
+      }
+      if( keys.empty() || fc::time_point::now() > _deadline ) {
+        return false;
+      }
+
+      bool first = true;
+      _out.push_back('{');
+      for( auto s = chain.rbegin(); s != chain.rend(); ++s ) {
+        for( const auto& field : (*s)->fields ) {
+          if( !first ) {
+            _out.push_back(',');
+          }
+          first = false;
+          if( !escape(field.name.data(), field.name.size()) ) {
+            return false;
+          }
+          _out.push_back(':');
+          if( !abi_value(abi, field.type, ds, depth + 1) ) {
+            return false;
+          }
+        }
+      }
+      _out.push_back('}');
+      return true;
+    }
+
+    template<typename T>
+    T unpack(fc::datastream<const char*>& ds)
+    {
+      T v;
+      fc::raw::unpack(ds, v);
+      return v;
+    }
+
+    // Leaf values are converted the same way as abi_serializer's built-in
+    // types, which make a variant of the unpacked value.
+    bool leaf_value(abi_leaf leaf, fc::datastream<const char*>& ds)
+    {
+      switch( leaf ) {
+      case abi_leaf::boolean:
+        {
+          const uint8_t v = unpack<uint8_t>(ds);
+          if( v > 1 ) {
+            return false;
+          }
+          value(v != 0);
+        }
+        break;
+      case abi_leaf::int8:            value(int64_t(unpack<int8_t>(ds))); break;
+      case abi_leaf::uint8:           value(uint64_t(unpack<uint8_t>(ds))); break;
+      case abi_leaf::int16:           value(int64_t(unpack<int16_t>(ds))); break;
+      case abi_leaf::uint16:          value(uint64_t(unpack<uint16_t>(ds))); break;
+      case abi_leaf::int32:           value(int64_t(unpack<int32_t>(ds))); break;
+      case abi_leaf::uint32:          value(uint64_t(unpack<uint32_t>(ds))); break;
+      case abi_leaf::int64:           value(unpack<int64_t>(ds)); break;
+      case abi_leaf::uint64:          value(unpack<uint64_t>(ds)); break;
+      case abi_leaf::varint32:        fallback(unpack<fc::signed_int>(ds)); break;
+      case abi_leaf::varuint32:       value(unpack<fc::unsigned_int>(ds)); break;
+      case abi_leaf::float32:         fallback(unpack<float>(ds)); break;
+      case abi_leaf::float64:         fallback(unpack<double>(ds)); break;
+      case abi_leaf::name:            value(unpack<name>(ds)); break;
+      case abi_leaf::string:          value(unpack<string>(ds)); break;
+      case abi_leaf::bytes:           value(unpack<bytes>(ds)); break;
+      case abi_leaf::checksum160:     value(unpack<fc::ripemd160>(ds)); break;
+      case abi_leaf::checksum256:     value(unpack<fc::sha256>(ds)); break;
+      case abi_leaf::checksum512:     value(unpack<fc::sha512>(ds)); break;
+      case abi_leaf::asset:           value(unpack<asset>(ds)); break;
+      case abi_leaf::symbol:          fallback(unpack<symbol>(ds)); break;
+      case abi_leaf::time_point:      fallback(unpack<fc::time_point>(ds)); break;
+      case abi_leaf::time_point_sec:  fallback(unpack<fc::time_point_sec>(ds)); break;
+      case abi_leaf::block_timestamp: fallback(unpack<block_timestamp_type>(ds)); break;
+      case abi_leaf::public_key:      fallback(unpack<public_key_type>(ds)); break;
+      case abi_leaf::signature:       fallback(unpack<signature_type>(ds)); break;
+      case abi_leaf::none:            return false;
+      }
+      return true;
+    }
+
+    void key(const char* k, bool& first)
+    {
+      if( !first ) {
+        _out.push_back(',');
+      }
+      first = false;
+      _out.push_back('"');
+      _out.append(k);
+      _out.append("\":");
+    }
+
+    void append_uint(uint64_t v)
+    {
+      char buf[24];
+      char* p = buf + sizeof(buf);
+      do {
+        *--p = char('0' + v % 10);
+        v /= 10;
+      } while( v != 0 );
+      _out.append(p, buf + sizeof(buf) - p);
+    }
+
+    // strings known not to need escaping
+    void raw_string(const string& s)
+    {
+      _out.push_back('"');
+      _out.append(s);
+      _out.push_back('"');
+    }
+
+    void hex_string(const char* data, size_t size)
+    {
+      static const char digits[] = "0123456789abcdef";
+      const size_t pos = _out.size();
+      _out.resize(pos + size * 2 + 2);
+      char* p = &_out[pos];
+      *p++ = '"';
+      for( size_t i = 0; i < size; ++i ) {
+        *p++ = digits[uint8_t(data[i]) >> 4];
+        *p++ = digits[uint8_t(data[i]) & 0x0f];
+      }
+      *p = '"';
+    }
+
+    // Printable ASCII with the common escapes. Returns false without
+    // writing anything if the string has other characters.
+    bool escape(const char* s, size_t size)
+    {
+      for( size_t i = 0; i < size; ++i ) {
+        const uint8_t c = s[i];
+        if( (c < 0x20 || c > 0x7e) && c != '\b' && c != '\f' && c != '\n' && c != '\r' && c != '\t' ) {
+          return false;
+        }
+      }
+      _out.push_back('"');
+      for( size_t i = 0; i < size; ++i ) {
+        switch( s[i] ) {
+        case '\b': _out.append("\\b"); break;
+        case '\f': _out.append("\\f"); break;
+        case '\n': _out.append("\\n"); break;
+        case '\r': _out.append("\\r"); break;
+        case '\t': _out.append("\\t"); break;
+        case '\\': _out.append("\\\\"); break;
+        case '"':  _out.append("\\\""); break;
+        default:   _out.push_back(s[i]);
+        }
+      }
+      _out.push_back('"');
+      return true;
+    }
+
+    static constexpr uint32_t MAX_ABI_DEPTH = 24;  // abi_serializer stops at 32 nested scopes
+
+    string&           _out;
+    fc::time_point    _deadline;
+  };
+
+  template<> struct json_writer::plain_reflected<action_receipt> : std::true_type {};
+  template<> struct json_writer::plain_reflected<permission_level> : std::true_type {};
+  template<> struct json_writer::plain_reflected<account_resource_limit> : std::true_type {};
+  template<> struct json_writer::plain_reflected<resource_balance> : std::true_type {};
+  template<> struct json_writer::plain_reflected<currency_balance> : std::true_type {};
+  template<> struct json_writer::plain_reflected<zmq_schema_ref> : std::true_type {};
+
+  // Traces of applied transactions, waiting for their block to be
+  // accepted. Every entry is tagged with the number of the block it was
+  // applied in. Traces of speculatively executed transactions which never
+  // make it into that block are pruned when the block is accepted, and the
+  // oldest entries are evicted when the estimated memory use exceeds the
+  // limit.
+  class trace_cache {
+  public:
+    void set_capacity(size_t bytes) { _capacity = bytes; }
+
+    void insert(const transaction_trace_ptr& trace, block_num_type block_num)
+    {
+      erase(trace->id);
+      const size_t bytes = trace_size(*trace);
+      _lru.push_back(trace->id);
+      _entries.emplace(trace->id, entry{trace, block_num, bytes, std::prev(_lru.end())});
+      _bytes += bytes;
+      while( _bytes > _capacity && _entries.size() > 1 ) {
+        erase(_lru.front());
+        ++evictions;
+      }
+    }
+
+    transaction_trace_ptr find(const transaction_id_type& id)
+    {
+      auto it = _entries.find(id);
+      if( it == _entries.end() ) {
+        ++misses;
+        return transaction_trace_ptr();
+      }
+      ++hits;
+      return it->second.trace;
+    }
+
+    // removes the traces applied in blocks up to the given one
+    void prune(block_num_type block_num)
+    {
+      for( auto it = _lru.begin(); it != _lru.end(); ) {
+        auto e = _entries.find(*it);
+        ++it;
+        if( e->second.block_num <= block_num ) {
+          erase(e->first);
+        }
+      }
+    }
+
+    size_t size() const { return _entries.size(); }
+    size_t bytes() const { return _bytes; }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+  private:
+    struct entry {
+      transaction_trace_ptr                     trace;
+      block_num_type                            block_num;
+      size_t                                    bytes;
+      std::list<transaction_id_type>::iterator  lru_pos;
+    };
+
+    struct id_hash {
+      size_t operator()(const transaction_id_type& id) const { return static_cast<size_t>(id._hash[0]); }
+    };
+
+    void erase(const transaction_id_type& id)
+    {
+      auto it = _entries.find(id);
+      if( it != _entries.end() ) {
+        _bytes -= it->second.bytes;
+        _lru.erase(it->second.lru_pos);
+        _entries.erase(it);
+      }
+    }
+
+    // approximate heap usage of a trace tree
+    static size_t trace_size(const transaction_trace& trace)
+    {
+      size_t bytes = sizeof(transaction_trace);
+      for( const auto& at : trace.action_traces ) {
+        bytes += action_size(at);
+      }
+      return bytes;
+    }
+
+    static size_t action_size(const action_trace& at)
+    {
+      size_t bytes = sizeof(action_trace) + at.act.data.size() + at.console.size() +
+        at.act.authorization.size() * sizeof(permission_level);
+      for( const auto& iline : at.inline_traces ) {
+        bytes += action_size(iline);
+      }
+      return bytes;
+    }
+
+    size_t                                                          _capacity = 0;
+    size_t                                                          _bytes = 0;
+    std::unordered_map<transaction_id_type, entry, id_hash>         _entries;
+    std::list<transaction_id_type>                                  _lru;
+  };
+
+  // Balances last sent to one output, for the delta-only balance mode.
+  // Entries are never evicted; the cache is cleared on the periodic
+  // refresh, on forks and whenever messages are lost.
+  class sent_balances {
+  public:
+    // returns true if the balance differs from the one sent last
+    bool update(const resource_balance& bal)
+    {
+      auto it = _resources.find(bal.account_name.value);
+      if( it != _resources.end() && same(it->second, bal) ) {
+        return false;
+      }
+      _resources[bal.account_name.value] = bal;
+      return true;
+    }
+
+    // Appends the changed currency balances of the account. A balance
+    // that disappeared (the row was closed) is reported as zero.
+    void update(name account, name contract, const vector<currency_balance>& current,
+                vector<currency_balance>& changed)
+    {
+      auto& sent = _currency[std::make_pair(account.value, contract.value)];
+      for( const auto& bal : current ) {
+        auto it = std::find_if(sent.begin(), sent.end(), [&](const currency_balance& s) {
+            return s.balance.get_symbol() == bal.balance.get_symbol();
+          });
+        if( it == sent.end() || it->balance != bal.balance ) {
+          changed.emplace_back(bal);
+        }
+      }
+      for( const auto& s : sent ) {
+        auto it = std::find_if(current.begin(), current.end(), [&](const currency_balance& bal) {
+            return s.balance.get_symbol() == bal.balance.get_symbol();
+          });
+        if( it == current.end() ) {
+          changed.emplace_back(currency_balance{account, contract, asset(0, s.balance.get_symbol())});
+        }
+      }
+      sent = current;
+    }
+
+    void clear()
+    {
+      _resources.clear();
+      _currency.clear();
+    }
+
+  private:
+    static bool same(const account_resource_limit& a, const account_resource_limit& b)
+    {
+      return a.used == b.used && a.available == b.available && a.max == b.max;
+    }
+
+    static bool same(const resource_balance& a, const resource_balance& b)
+    {
+      return a.ram_quota == b.ram_quota && a.ram_usage == b.ram_usage &&
+        a.net_weight == b.net_weight && a.cpu_weight == b.cpu_weight &&
+        same(a.net_limit, b.net_limit) && same(a.cpu_limit, b.cpu_limit);
+    }
+
+    std::unordered_map<uint64_t, resource_balance>                      _resources;
+    std::map<std::pair<uint64_t,uint64_t>, vector<currency_balance>>    _currency;
+  };
+
+  // Row of the columnar output: an action, including the inline ones.
+  // Balances are attached to the row of the top-level action.
+  struct columnar_row {
+    block_num_type                 block_num = 0;
+    int64_t                        block_time_ms = 0;
+    uint64_t                       global_action_seq = 0;
+    string                         trx_id;
+    name                           receiver;
+    name                           contract;
+    name                           action;
+    vector<string>                 authorizations;  // actor@permission
+    bytes                          data;
+    vector<resource_balance>       resource_balances;
+    vector<currency_balance>       currency_balances;
+  };
+
+  // Action traces collected for the columnar output. The rows are written
+  // as one Arrow record batch in IPC stream format.
+  class columnar_batch {
+  public:
+    void add(const zmq_action_object& zao, const action_trace& at)
+    {
+      add_row(zao, at, true);
+    }
+
+    // drops the rows of blocks replaced by a fork
+    void erase_from(block_num_type block_num)
+    {
+      while( !_rows.empty() && _rows.back().block_num >= block_num ) {
+        _rows.pop_back();
+      }
+    }
+
+    bool empty() const { return _rows.empty(); }
+
+    // moves the rows of another batch to the end of this one
+    void append(columnar_batch& other)
+    {
+      _rows.insert(_rows.end(), std::make_move_iterator(other._rows.begin()),
+                   std::make_move_iterator(other._rows.end()));
+      other._rows.clear();
+    }
+
+    vector<columnar_row>& rows() { return _rows; }
+
+    // appends the IPC stream to out, and clears the rows
+    void finish(string& out)
+    {
+#ifdef ZMQ_PLUGIN_HAVE_ARROW
+      auto* pool = arrow::default_memory_pool();
+      arrow::UInt32Builder block_num(pool);
+      arrow::TimestampBuilder block_time(arrow::timestamp(arrow::TimeUnit::MILLI), pool);
+      arrow::UInt64Builder global_action_seq(pool);
+      arrow::StringBuilder trx_id(pool);
+      arrow::StringBuilder receiver(pool);
+      arrow::StringBuilder contract(pool);
+      arrow::StringBuilder action(pool);
+      auto actor = std::make_shared<arrow::StringBuilder>(pool);
+      arrow::ListBuilder authorizations(pool, actor);
+      arrow::BinaryBuilder data(pool);
+
+      auto res_account = std::make_shared<arrow::StringBuilder>(pool);
+      auto ram_quota = std::make_shared<arrow::Int64Builder>(pool);
+      auto ram_usage = std::make_shared<arrow::Int64Builder>(pool);
+      auto net_weight = std::make_shared<arrow::Int64Builder>(pool);
+      auto cpu_weight = std::make_shared<arrow::Int64Builder>(pool);
+      auto resource = struct_builder(pool, {"account", "ram_quota", "ram_usage", "net_weight", "cpu_weight"},
+                                     {res_account, ram_quota, ram_usage, net_weight, cpu_weight});
+      arrow::ListBuilder resource_balances(pool, resource);
+
+      auto cur_account = std::make_shared<arrow::StringBuilder>(pool);
+      auto cur_contract = std::make_shared<arrow::StringBuilder>(pool);
+      auto amount = std::make_shared<arrow::Int64Builder>(pool);
+      auto symbol_name = std::make_shared<arrow::StringBuilder>(pool);
+      auto precision = std::make_shared<arrow::UInt8Builder>(pool);
+      auto currency = struct_builder(pool, {"account", "contract", "amount", "symbol", "precision"},
+                                     {cur_account, cur_contract, amount, symbol_name, precision});
+      arrow::ListBuilder currency_balances(pool, currency);
+
+      for( const auto& r : _rows ) {
+        check(block_num.Append(r.block_num));
+        check(block_time.Append(r.block_time_ms));
+        check(global_action_seq.Append(r.global_action_seq));
+        check(trx_id.Append(r.trx_id));
+        check(receiver.Append(r.receiver.to_string()));
+        check(contract.Append(r.contract.to_string()));
+        check(action.Append(r.action.to_string()));
+        check(authorizations.Append());
+        for( const auto& a : r.authorizations ) {
+          check(actor->Append(a));
+        }
+        check(data.Append(reinterpret_cast<const uint8_t*>(r.data.data()), r.data.size()));
+
+        check(resource_balances.Append());
+        for( const auto& b : r.resource_balances ) {
+          check(resource->Append());
+          check(res_account->Append(b.account_name.to_string()));
+          check(ram_quota->Append(b.ram_quota));
+          check(ram_usage->Append(b.ram_usage));
+          check(net_weight->Append(b.net_weight));
+          check(cpu_weight->Append(b.cpu_weight));
+        }
+
+        check(currency_balances.Append());
+        for( const auto& b : r.currency_balances ) {
+          check(currency->Append());
+          check(cur_account->Append(b.account_name.to_string()));
+          check(cur_contract->Append(b.contract.to_string()));
+          check(amount->Append(b.balance.get_amount()));
+          check(symbol_name->Append(b.balance.get_symbol().name()));
+          check(precision->Append(b.balance.get_symbol().decimals()));
+        }
+      }
+
+      const vector<std::pair<const char*, arrow::ArrayBuilder*>> columns = {
+        {"block_num", &block_num}, {"block_time", &block_time}, {"global_action_seq", &global_action_seq},
+        {"trx_id", &trx_id}, {"receiver", &receiver}, {"contract", &contract}, {"action", &action},
+        {"authorizations", &authorizations}, {"data", &data},
+        {"resource_balances", &resource_balances}, {"currency_balances", &currency_balances}
+      };
+      std::vector<std::shared_ptr<arrow::Field>> fields;
+      std::vector<std::shared_ptr<arrow::Array>> arrays;
+      for( const auto& c : columns ) {
+        std::shared_ptr<arrow::Array> array;
+        check(c.second->Finish(&array));
+        fields.push_back(arrow::field(c.first, array->type()));
+        arrays.push_back(array);
+      }
+      auto schema = arrow::schema(fields);
+      auto batch = arrow::RecordBatch::Make(schema, _rows.size(), arrays);
+
+      auto sink = value_of(arrow::io::BufferOutputStream::Create(64 * 1024, pool));
+      auto writer = value_of(arrow::ipc::MakeStreamWriter(sink.get(), schema));
+      check(writer->WriteRecordBatch(*batch));
+      check(writer->Close());
+      auto buffer = value_of(sink->Finish());
+      out.append(reinterpret_cast<const char*>(buffer->data()), buffer->size());
+#else
+      EOS_ASSERT( false, plugin_exception, "zmq_plugin is compiled without Arrow support" );
+#endif
+      _rows.clear();
+    }
+
+  private:
+    void add_row(const zmq_action_object& zao, const action_trace& at, bool top)
+    {
+      columnar_row r;
+      r.block_num = zao.block_num;
+      r.block_time_ms = zao.block_time.to_time_point().time_since_epoch().count() / 1000;
+      r.global_action_seq = at.receipt.global_sequence;
+      r.trx_id = at.trx_id.str();
+      r.receiver = at.receipt.receiver;
+      r.contract = at.act.account;
+      r.action = at.act.name;
+      for( const auto& auth : at.act.authorization ) {
+        r.authorizations.emplace_back(auth.actor.to_string() + "@" + auth.permission.to_string());
+      }
+      r.data = at.act.data;
+      if( top ) {
+        r.resource_balances = zao.resource_balances;
+        r.currency_balances = zao.currency_balances;
+      }
+      _rows.emplace_back(std::move(r));
+
+      for( const auto& iline : at.inline_traces ) {
+        add_row(zao, iline, false);
+      }
+    }
+
+#ifdef ZMQ_PLUGIN_HAVE_ARROW
+    static void check(const arrow::Status& status)
+    {
+      EOS_ASSERT( status.ok(), plugin_exception, "Arrow error: ${e}", ("e", status.ToString()) );
+    }
+
+    template<typename T>
+    static T value_of(arrow::Result<T>&& result)
+    {
+      check(result.status());
+      return std::move(result).ValueOrDie();
+    }
+
+    static std::shared_ptr<arrow::StructBuilder> struct_builder(arrow::MemoryPool* pool,
+                                                                const vector<string>& names,
+                                                                std::vector<std::shared_ptr<arrow::ArrayBuilder>> children)
+    {
+      std::vector<std::shared_ptr<arrow::Field>> fields;
+      for( size_t i = 0; i < names.size(); ++i ) {
+        fields.push_back(arrow::field(names[i], children[i]->type()));
+      }
+      return std::make_shared<arrow::StructBuilder>(arrow::struct_(fields), pool, std::move(children));
+    }
+#endif
+
+    vector<columnar_row>             _rows;
+  };
+
+  // Open-addressing hash set of name triples. It is built once at startup
+  // and only read afterwards.
+  class name_key_set {
+  public:
+    void insert(uint64_t a, uint64_t b = 0, uint64_t c = 0)
+    {
+      if( (_size + 1) * 2 > _slots.size() ) {
+        grow();
+      }
+      if( put(_slots, a, b, c) ) {
+        ++_size;
+      }
+    }
+
+    bool contains(uint64_t a, uint64_t b = 0, uint64_t c = 0) const
+    {
+      if( _size == 0 ) {
+        return false;
+      }
+      const size_t mask = _slots.size() - 1;
+      for( size_t i = hash(a, b, c) & mask; _slots[i].used; i = (i + 1) & mask ) {
+        if( _slots[i].a == a && _slots[i].b == b && _slots[i].c == c ) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool empty() const { return _size == 0; }
+
+  private:
+    struct slot {
+      uint64_t a = 0;
+      uint64_t b = 0;
+      uint64_t c = 0;
+      bool     used = false;
+    };
+
+    static size_t hash(uint64_t a, uint64_t b, uint64_t c)
+    {
+      uint64_t h = a * 0x9E3779B97F4A7C15ULL;
+      h ^= (b + 0x632BE59BD9B4E019ULL + (h << 6) + (h >> 2)) * 0xC2B2AE3D27D4EB4FULL;
+      h ^= (c + 0x85EBCA77C2B2AE63ULL + (h << 6) + (h >> 2)) * 0x165667B19E3779F9ULL;
+      return static_cast<size_t>(h ^ (h >> 29));
+    }
+
+    static bool put(std::vector<slot>& slots, uint64_t a, uint64_t b, uint64_t c)
+    {
+      const size_t mask = slots.size() - 1;
+      size_t i = hash(a, b, c) & mask;
+      for( ; slots[i].used; i = (i + 1) & mask ) {
+        if( slots[i].a == a && slots[i].b == b && slots[i].c == c ) {
+          return false;
+        }
+      }
+      slots[i] = slot{a, b, c, true};
+      return true;
+    }
+
+    void grow()
+    {
+      std::vector<slot> bigger(_slots.empty() ? 16 : _slots.size() * 2);
+      for( const auto& s : _slots ) {
+        if( s.used ) {
+          put(bigger, s.a, s.b, s.c);
+        }
+      }
+      _slots.swap(bigger);
+    }
+
+    std::vector<slot>  _slots;
+    size_t             _size = 0;
+  };
+
+  // Set of filter rules in the form "contract:action:receiver", where each
+  // part may be a wildcard ("*" or empty). The receiver part matches the
+  // action receiver or any account notified of the action. Rules are
+  // grouped by which of the parts are wildcards, so a match takes at most
+  // one hash lookup per group.
+  class action_filter {
+  public:
+    void add_rule(const string& rule)
+    {
+      std::vector<string> parts;
+      size_t start = 0;
+      while( true ) {
+        size_t pos = rule.find(':', start);
+        parts.emplace_back(rule.substr(start, pos == string::npos ? string::npos : pos - start));
+        if( pos == string::npos ) {
+          break;
+        }
+        start = pos + 1;
+      }
+      EOS_ASSERT( parts.size() <= 3, plugin_config_exception,
+                  "Invalid filter rule: ${r}, expected contract:action:receiver", ("r", rule) );
+      parts.resize(3);
+
+      uint64_t key[3];
+      uint32_t mask = 0;
+      for( size_t i = 0; i < 3; ++i ) {
+        if( parts[i].empty() || parts[i] == "*" ) {
+          key[i] = 0;
+        }
+        else {
+          key[i] = name(parts[i]).value;
+          mask |= (1 << i);
+        }
+      }
+      _rules[mask].insert(key[0], key[1], key[2]);
+      _masks_used |= (1 << mask);
+    }
+
+    bool empty() const { return _masks_used == 0; }
+
+    bool matches(const action_trace& at) const
+    {
+      for( uint32_t mask = 0; mask < 8; ++mask ) {
+        if( (_masks_used & (1 << mask)) == 0 ) {
+          continue;
+        }
+        const uint64_t contract = (mask & CONTRACT) ? at.act.account.value : 0;
+        const uint64_t action = (mask & ACTION) ? at.act.name.value : 0;
+        if( mask & RECEIVER ) {
+          if( matches_receiver(_rules[mask], contract, action, at, at) ) {
+            return true;
+          }
+        }
+        else if( _rules[mask].contains(contract, action, 0) ) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    enum : uint32_t { CONTRACT = 1, ACTION = 2, RECEIVER = 4 };
+
+    // notifications are inline traces of the same action with other receivers
+    static bool matches_receiver(const name_key_set& rules, uint64_t contract, uint64_t action,
+                                 const action_trace& top, const action_trace& at)
+    {
+      if( rules.contains(contract, action, at.receipt.receiver.value) ) {
+        return true;
+      }
+      for( const auto& iline : at.inline_traces ) {
+        if( iline.act.account == top.act.account && iline.act.name == top.act.name &&
+            matches_receiver(rules, contract, action, top, iline) ) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    name_key_set   _rules[8];
+    uint32_t       _masks_used = 0;
+  };
+
+  // Finds the accounts involved in an action, and the token contracts
+  // whose balances are reported, without unpacking the action data. The
+  // rules map (contract, action) to byte offsets of account name fields
+  // in the packed data, so only actions with fixed-position name fields
+  // can be described. Rules with an empty contract apply to any contract
+  // except the system one.
+  class account_extractor {
+  public:
+    account_extractor()
+    {
+      static const struct {
+        uint64_t action;
+        uint16_t offsets[2];
+      } system_rules[] = {
+        { N(newaccount),   { 8, NO_FIELD } },  // creator, name
+        { N(setcode),      { 0, NO_FIELD } },  // account
+        { N(setabi),       { 0, NO_FIELD } },  // account
+        { N(updateauth),   { 0, NO_FIELD } },  // account
+        { N(deleteauth),   { 0, NO_FIELD } },  // account
+        { N(linkauth),     { 0, NO_FIELD } },  // account
+        { N(unlinkauth),   { 0, NO_FIELD } },  // account
+        { N(buyrambytes),  { 0, 8 } },         // payer, receiver
+        { N(buyram),       { 0, 8 } },         // payer, receiver
+        { N(sellram),      { 0, NO_FIELD } },  // account
+        { N(delegatebw),   { 0, 8 } },         // from, receiver
+        { N(undelegatebw), { 0, 8 } },         // from, receiver
+        { N(refund),       { 0, NO_FIELD } },  // owner
+        { N(regproducer),  { 0, NO_FIELD } },  // producer
+        { N(unregprod),    { 0, NO_FIELD } },  // producer
+        { N(regproxy),     { 0, NO_FIELD } },  // proxy
+        { N(voteproducer), { 0, 8 } },         // voter, proxy; not including the producers list
+        { N(claimrewards), { 0, NO_FIELD } },  // owner
+        // bidname: the new name account does not exist yet
+      };
+      for( const auto& r : system_rules ) {
+        for( auto off : r.offsets ) {
+          if( off != NO_FIELD ) {
+            add_field(config::system_account_name, r.action, off);
+          }
+        }
+      }
+      for( auto action : { N(transfer), N(issue), N(open) } ) {
+        rule_for(0, action).token = true;
+      }
+    }
+
+    // contract:action:offset[,offset...], contract may be *
+    void add_fields_rule(const string& rule)
+    {
+      const auto parts = split_rule(rule, 3, "contract:action:offset[,offset...]");
+      const uint64_t contract = (parts[0] == "*") ? 0 : name(parts[0]).value;
+      size_t start = 0;
+      while( start <= parts[2].size() ) {
+        size_t pos = parts[2].find(',', start);
+        const string off = parts[2].substr(start, pos == string::npos ? string::npos : pos - start);
+        EOS_ASSERT( !off.empty() && off.find_first_not_of("0123456789") == string::npos &&
+                    std::stoul(off) < NO_FIELD, plugin_config_exception,
+                    "Invalid field offset in rule: ${r}", ("r", rule) );
+        add_field(contract, name(parts[1]).value, static_cast<uint16_t>(std::stoul(off)));
+        if( pos == string::npos ) {
+          break;
+        }
+        start = pos + 1;
+      }
+    }
+
+    // contract:action, contract may be *
+    void add_token_rule(const string& rule)
+    {
+      const auto parts = split_rule(rule, 2, "contract:action");
+      const uint64_t contract = (parts[0] == "*") ? 0 : name(parts[0]).value;
+      rule_for(contract, name(parts[1]).value).token = true;
+    }
+
+    // Appends the accounts and token contracts of this action, not
+    // including its inline traces. The results may contain duplicates.
+    void extract(const action_trace& at, vector<name>& accounts, vector<name>& token_contracts) const
+    {
+      accounts.push_back(at.act.account);
+      if( at.receipt.receiver != at.act.account ) {
+        accounts.push_back(at.receipt.receiver);
+      }
+
+      // a contract-specific rule adds to the wildcard one
+      const rule* specific = find(at.act.account.value, at.act.name.value);
+      const rule* wildcard = (at.act.account != config::system_account_name) ?
+        find(0, at.act.name.value) : nullptr;
+      bool token = false;
+      for( const rule* r : { specific, wildcard } ) {
+        if( r == nullptr ) {
+          continue;
+        }
+        for( auto off : r->offsets ) {
+          const name n = name_at(at.act.data, off);
+          if( n.value != 0 ) {
+            accounts.push_back(n);
+          }
+        }
+        token |= r->token;
+      }
+      if( token ) {
+        token_contracts.push_back(at.act.account);
+      }
+    }
+
+    // reads the account name at the given offset of the packed data, or
+    // the empty name if the data is too short
+    static name name_at(const bytes& data, uint16_t offset)
+    {
+      uint64_t value = 0;
+      if( size_t(offset) + sizeof(value) <= data.size() ) {
+        memcpy(&value, data.data() + offset, sizeof(value));
+      }
+      return name(value);
+    }
+
+  private:
+    static constexpr uint16_t NO_FIELD = 0xffff;
+
+    struct rule {
+      uint64_t                contract = 0;
+      uint64_t                action = 0;
+      std::vector<uint16_t>   offsets;
+      bool                    token = false;
+
+      bool operator<(const rule& other) const
+      {
+        return std::tie(contract, action) < std::tie(other.contract, other.action);
+      }
+    };
+
+    static std::vector<string> split_rule(const string& rule, size_t count, const char* format)
+    {
+      std::vector<string> parts;
+      size_t start = 0;
+      while( true ) {
+        size_t pos = rule.find(':', start);
+        parts.emplace_back(rule.substr(start, pos == string::npos ? string::npos : pos - start));
+        if( pos == string::npos ) {
+          break;
+        }
+        start = pos + 1;
+      }
+      EOS_ASSERT( parts.size() == count && !parts[0].empty() && !parts[1].empty(), plugin_config_exception,
+                  "Invalid rule: ${r}, expected ${f}", ("r", rule)("f", format) );
+      return parts;
+    }
+
+    void add_field(uint64_t contract, uint64_t action, uint16_t offset)
+    {
+      auto& offsets = rule_for(contract, action).offsets;
+      if( std::find(offsets.begin(), offsets.end(), offset) == offsets.end() ) {
+        offsets.push_back(offset);
+      }
+    }
+
+    // the rules are kept sorted for binary search
+    rule& rule_for(uint64_t contract, uint64_t action)
+    {
+      rule key;
+      key.contract = contract;
+      key.action = action;
+      auto it = std::lower_bound(_rules.begin(), _rules.end(), key);
+      if( it == _rules.end() || it->contract != contract || it->action != action ) {
+        it = _rules.insert(it, key);
+      }
+      return *it;
+    }
+
+    const rule* find(uint64_t contract, uint64_t action) const
+    {
+      rule key;
+      key.contract = contract;
+      key.action = action;
+      auto it = std::lower_bound(_rules.begin(), _rules.end(), key);
+      if( it == _rules.end() || it->contract != contract || it->action != action ) {
+        return nullptr;
+      }
+      return &*it;
+    }
+
+    std::vector<rule>   _rules;
+  };
+
+  // Subscription of one consumer, compiled for lookups on the chain thread
+  class consumer_subscription {
+  public:
+    explicit consumer_subscription(const zmq_subscription& sub)
+    {
+      for( const auto& n : sub.contracts ) _contracts.insert(n.value);
+      for( const auto& n : sub.actions ) _actions.insert(n.value);
+      for( const auto& n : sub.accounts ) _accounts.insert(n.value);
+      _msgtypes.insert(sub.msgtypes.begin(), sub.msgtypes.end());
+    }
+
+    bool wants_msgtype(int32_t msgtype) const
+    {
+      return _msgtypes.empty() || _msgtypes.count(msgtype) > 0;
+    }
+
+    bool wants_action(const action_trace& at, const vector<name>& accounts) const
+    {
+      if( !wants_msgtype(MSGTYPE_ACTION_TRACE) ) {
+        return false;
+      }
+      if( !_contracts.empty() && !_contracts.contains(at.act.account.value) ) {
+        return false;
+      }
+      if( !_actions.empty() && !_actions.contains(at.act.name.value) ) {
+        return false;
+      }
+      if( !_accounts.empty() ) {
+        for( const auto& acc : accounts ) {
+          if( _accounts.contains(acc.value) ) {
+            return true;
+          }
+        }
+        return false;
+      }
+      return true;
+    }
+
+  private:
+    name_key_set         _contracts;
+    name_key_set         _actions;
+    name_key_set         _accounts;
+    std::set<int32_t>    _msgtypes;
+  };
+
+  // Union of all consumer subscriptions. A new immutable instance is
+  // published by the control thread whenever a subscription changes.
+  class subscription_set {
+  public:
+    explicit subscription_set(const std::map<string, zmq_subscription>& subs)
+    {
+      for( const auto& s : subs ) {
+        _consumers.emplace_back(s.second);
+      }
+    }
+
+    bool wants_msgtype(int32_t msgtype) const
+    {
+      for( const auto& c : _consumers ) {
+        if( c.wants_msgtype(msgtype) ) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool wants_action(const action_trace& at, const vector<name>& accounts) const
+    {
+      for( const auto& c : _consumers ) {
+        if( c.wants_action(at, accounts) ) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    std::vector<consumer_subscription> _consumers;
+  };
+
+  // Lock-free single-producer single-consumer ring buffer. The chain thread
+  // is the only producer, and the sender thread is the only consumer.
+  template<typename T>
+  class spsc_ring {
+  public:
+    explicit spsc_ring(size_t capacity):
+      _slots(capacity),
+      _capacity(capacity)
+    {}
+
+    bool try_push(T& item)
+    {
+      const size_t tail = _tail.load(std::memory_order_relaxed);
+      if( tail - _head.load(std::memory_order_acquire) >= _capacity ) {
+        return false;
+      }
+      _slots[tail % _capacity] = std::move(item);
+      _tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool try_pop(T& item)
+    {
+      const size_t head = _head.load(std::memory_order_relaxed);
+      if( head == _tail.load(std::memory_order_acquire) ) {
+        return false;
+      }
+      item = std::move(_slots[head % _capacity]);
+      _head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    size_t size() const
+    {
+      return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+    }
+
+  private:
+    std::vector<T>       _slots;
+    const size_t         _capacity;
+    std::atomic<size_t>  _head{0};
+    std::atomic<size_t>  _tail{0};
+  };
+}
+
+
+namespace eosio {
+  using namespace chain;
+  using namespace zmqplugin;
+  using boost::signals2::scoped_connection;
+
+  // Benchmark fixture file: a sequence of records, each consisting of a
+  // 1-byte record type, a 32-bit payload size, and the fc::raw packed
+  // payload. Traces and blocks are in the order the plugin received them.
+  enum fixture_record_type : uint8_t {
+    FIXTURE_TRACE = 0,   // transaction_trace
+    FIXTURE_BLOCK = 1,   // signed_block
+    FIXTURE_ABI = 2      // fixture_abi
+  };
+
+  struct fixture_abi {
+    name                         account;
+    uint64_t                     abi_sequence = 0;
+    bytes                        abi;
+  };
+
+  // Messages of a block waiting to become irreversible, saved at shutdown
+  // in irreversible-only mode. The file starts with the block range and
+  // the message count, so that a loss can be reported even if the rest of
+  // the file is unreadable.
+  struct saved_message {
+    int32_t                      msgtype = 0;
+    int32_t                      msgopts = 0;
+    uint64_t                     global_action_seq = 0;
+    int32_t                      shard = -1;
+    string                       topic;
+    string                       content;     // including the header
+  };
+
+  struct saved_block {
+    block_num_type               block_num = 0;
+    digest_type                  digest;
+    vector<saved_message>        messages;
+    vector<vector<columnar_row>> columnar;    // per output
+  };
+
+  class fixture_recorder {
+  public:
+    explicit fixture_recorder(const bfs::path& file):
+      _out(file.generic_string(), std::ios::binary | std::ios::trunc)
+    {
+      EOS_ASSERT( _out.good(), plugin_config_exception, "Cannot open ${f}", ("f", file.generic_string()) );
+    }
+
+    void record_trace(const transaction_trace& trace) { write(FIXTURE_TRACE, fc::raw::pack(trace)); }
+    void record_block(const signed_block& block) { write(FIXTURE_BLOCK, fc::raw::pack(block)); }
+
+    void record_abi(name account, uint64_t abi_sequence, const bytes& abi)
+    {
+      write(FIXTURE_ABI, fc::raw::pack(fixture_abi{account, abi_sequence, abi}));
+    }
+
+  private:
+    void write(uint8_t type, const vector<char>& payload)
+    {
+      const uint32_t size = payload.size();
+      _out.write((const char*) &type, sizeof(type));
+      _out.write((const char*) &size, sizeof(size));
+      _out.write(payload.data(), payload.size());
+    }
+
+    std::ofstream  _out;
+  };
+
+  // Chain state read by the pipeline on the chain thread. The plugin reads
+  // the controller, and the benchmark uses a stand-in.
+  class chain_state {
+  public:
+    virtual ~chain_state() {}
+    virtual block_num_type head_block_num() const = 0;
+    virtual block_num_type last_irreversible_block_num() const = 0;
+    // returns false if the account does not exist
+    virtual bool get_abi_sequence(name account, uint64_t& abi_sequence) const = 0;
+    virtual bytes get_abi(name account) const = 0;
+    virtual resource_balance get_resource_balance(name account) const = 0;
+    virtual vector<currency_balance> get_currency_balances(name account, name token_code) const = 0;
+    // all accounts, in name order
+    virtual vector<name> get_accounts() const = 0;
+    // scopes of the accounts table of a token contract
+    virtual vector<name> get_token_holders(name token_code) const = 0;
+    // rows of the given contracts changed in the block being accepted
+    virtual vector<zmq_table_delta> get_table_deltas(block_num_type block_num,
+                                                     const std::set<name>& contracts) const = 0;
+  };
+
+  class controller_state : public chain_state {
+  public:
+    explicit controller_state(const controller& chain): _chain(chain) {}
+
+    block_num_type head_block_num() const override { return _chain.head_block_num(); }
+    block_num_type last_irreversible_block_num() const override { return _chain.last_irreversible_block_num(); }
+
+    bool get_abi_sequence(name account, uint64_t& abi_sequence) const override
+    {
+      const auto* seq = _chain.db().find<account_sequence_object, by_name>(account);
+      if( seq == nullptr ) {
+        return false;
+      }
+      abi_sequence = seq->abi_sequence;
+      return true;
+    }
+
+    bytes get_abi(name account) const override
+    {
+      return _chain.get_account(account).abi;
+    }
+
+    resource_balance get_resource_balance(name account) const override
+    {
+      resource_balance bal;
+      bal.account_name = account;
+
+      const auto& rm = _chain.get_resource_limits_manager();
+      rm.get_account_limits( account, bal.ram_quota, bal.net_weight, bal.cpu_weight );
+      bool grelisted = _chain.is_resource_greylisted(account);
+      bal.net_limit = rm.get_account_net_limit_ex( account, !grelisted);
+      bal.cpu_limit = rm.get_account_cpu_limit_ex( account, !grelisted);
+      bal.ram_usage = rm.get_account_ram_usage( account );
+      return bal;
+    }
+
+    vector<currency_balance> get_currency_balances(name account_name, name token_code) const override
+    {
+      vector<currency_balance> result;
+      const auto& db = _chain.db();
+
+      const auto* t_id = db.find<chain::table_id_object, chain::by_code_scope_table>
+        (boost::make_tuple( token_code, account_name, N(accounts) ));
+      if( t_id != nullptr ) {
+          const auto &idx = db.get_index<key_value_index, by_scope_primary>();
+          decltype(t_id->id) next_tid(t_id->id._id + 1);
+          auto lower = idx.lower_bound(boost::make_tuple(t_id->id));
+          auto upper = idx.lower_bound(boost::make_tuple(next_tid));
+
+          for (auto obj = lower; obj != upper; ++obj) {
+            if( obj->value.size() >= sizeof(asset) ) {
+              asset bal;
+              fc::datastream<const char *> ds(obj->value.data(), obj->value.size());
+              fc::raw::unpack(ds, bal);
+              if( bal.get_symbol().valid() ) {
+                result.emplace_back(currency_balance{account_name, token_code, bal});
+              }
+            }
+          }
+      }
+      return result;
+    }
+
+    vector<name> get_accounts() const override
+    {
+      vector<name> result;
+      const auto& idx = _chain.db().get_index<account_index, by_name>();
+      result.reserve(idx.size());
+      for( const auto& a : idx ) {
+        result.push_back(a.name);
+      }
+      return result;
+    }
+
+    vector<name> get_token_holders(name token_code) const override
+    {
+      vector<name> result;
+      const auto& idx = _chain.db().get_index<chain::table_id_multi_index, chain::by_code_scope_table>();
+      for( auto it = idx.lower_bound(boost::make_tuple(token_code)); it != idx.end() && it->code == token_code; ++it ) {
+        if( it->table == N(accounts) ) {
+          result.push_back(it->scope);
+        }
+      }
+      return result;
+    }
+
+    // The changes of the block are read from the undo session of the
+    // contract rows index, which is still open when the block is accepted.
+    // Rows inserted and removed within the block are not in the session.
+    vector<zmq_table_delta> get_table_deltas(block_num_type block_num,
+                                             const std::set<name>& contracts) const override
+    {
+      vector<zmq_table_delta> result;
+      const auto& tables = _chain.db().get_index<chain::table_id_multi_index>();
+      const auto& rows = _chain.db().get_index<chain::key_value_index>();
+
+      // the undo sessions are chainbase internals
+      using undo_state = std::decay<decltype(rows.stack().back())>::type;
+      static_assert( std::is_same<decltype(undo_state::revision), int64_t>::value &&
+                     std::is_same<decltype(undo_state::new_ids)::value_type,
+                                  chain::key_value_object::id_type>::value &&
+                     std::is_same<decltype(undo_state::old_values)::mapped_type, chain::key_value_object>::value &&
+                     std::is_same<decltype(undo_state::removed_values)::mapped_type, chain::key_value_object>::value,
+                     "get_table_deltas() does not support this chainbase undo_state layout" );
+
+      if( rows.stack().empty() || rows.stack().back().revision != int64_t(block_num) ) {
+        // no undo session of the block, during replay for instance
+        if( !_deltas_unavailable ) {
+          wlog("Table deltas are not sent from block ${b}: the undo session revision is ${r}",
+               ("b", block_num)("r", rows.stack().empty() ? int64_t(-1) : rows.stack().back().revision));
+          _deltas_unavailable = true;
+        }
+        return result;
+      }
+      if( _deltas_unavailable ) {
+        ilog("Table deltas are sent again from block ${b}", ("b", block_num));
+        _deltas_unavailable = false;
+      }
+      const auto& row_undo = rows.stack().back();
+      const auto& table_undo = tables.stack().back();
+
+      std::map<chain::table_id, const chain::table_id_object*> table_cache;
+      auto find_table = [&](chain::table_id id) -> const chain::table_id_object* {
+        auto it = table_cache.find(id);
+        if( it != table_cache.end() ) {
+          return it->second;
+        }
+        const chain::table_id_object* t = tables.find(id);
+        if( t == nullptr ) {
+          // the table was removed together with its last row
+          auto removed = table_undo.removed_values.find(id);
+          if( removed != table_undo.removed_values.end() ) {
+            t = &removed->second;
+          }
+        }
+        if( t != nullptr && contracts.count(t->code) == 0 ) {
+          t = nullptr;
+        }
+        table_cache.emplace(id, t);
+        return t;
+      };
+
+      auto add = [&](const char* operation, const chain::key_value_object& row) {
+        const auto* t = find_table(row.t_id);
+        if( t != nullptr ) {
+          result.emplace_back(zmq_table_delta{operation, t->code, t->scope, t->table, row.primary_key, row.payer,
+                                              bytes(row.value.data(), row.value.data() + row.value.size())});
+        }
+      };
+
+      for( const auto& id : row_undo.new_ids ) {
+        const auto* row = rows.find(id);
+        if( row != nullptr ) {
+          add("insert", *row);
+        }
+      }
+      for( const auto& old : row_undo.old_values ) {
+        const auto* row = rows.find(old.first);
+        if( row != nullptr ) {
+          add("update", *row);
+        }
+      }
+      for( const auto& removed : row_undo.removed_values ) {
+        add("remove", removed.second);
+      }
+
+      std::sort(result.begin(), result.end(), [](const zmq_table_delta& a, const zmq_table_delta& b) {
+          return std::tie(a.code, a.table, a.scope, a.primary_key) < std::tie(b.code, b.table, b.scope, b.primary_key);
+        });
+      return result;
+    }
+
+  private:
+    const controller&  _chain;
+    mutable bool       _deltas_unavailable = false;  // chain thread only
+  };
+
+  class zmq_plugin_impl {
+  public:
+    // declared first so that it outlives the ZMQ context and the queued messages
+    buffer_pool buffers;
+    plugin_metrics metrics;
+    zmq::context_t context;
+    std::vector<std::unique_ptr<sender_output>> outputs;
+    shard_key              sharding = shard_key::contract;
+    bool                   pub_mode = false;
+    sender_options         output_opts;
+    chain_plugin*          chain_plug = nullptr;
+    std::unique_ptr<chain_state> state;
+    std::unique_ptr<fixture_recorder> recorder;
+    fc::microseconds       abi_serializer_max_time;
+    zmqplugin::abi_cache   abi_serializers;
+    std::unique_ptr<worker_pool> serializers;
+
+    // Subscriptions are managed by the control thread. Null means that no
+    // consumer has subscribed, and everything is sent.
+    string                                    control_bind_str;
+    std::unique_ptr<zmq::socket_t>            control_socket;
+    std::thread                               control_thread;
+    std::map<string, zmq_subscription>        subscription_specs;
+    std::shared_ptr<const subscription_set>   subscriptions;
+    std::shared_ptr<const subscription_set>   block_subscriptions;
+
+    // used by the sender thread only
+    std::unique_ptr<message_compressor>       compressor;
+
+    // the journal is written by the sender thread and read by the control thread
+    std::unique_ptr<message_journal>          journal;
+    uint32_t                                  journal_retention = JOURNAL_RETENTION_DEFAULT;
+    std::atomic<block_num_type>               irreversible_block_num{0};
+    block_num_type                            journal_trimmed_at = 0;
+    string                                    journal_bind_str;
+    std::unique_ptr<zmq::socket_t>            journal_socket;
+
+    // balance lookups are identical within a block, so they are memoized
+    // until the end of on_accepted_block
+    std::unordered_map<uint64_t, resource_balance> block_resource_balances;
+    std::map<std::pair<uint64_t,uint64_t>, vector<currency_balance>> block_currency_balances;
+
+    // In delta-only balance mode, action traces only contain balances that
+    // changed since they were last sent to the same output
+    bool                   balance_deltas = false;
+    uint32_t               balance_refresh_blocks = BALANCE_REFRESH_DEFAULT;
+    vector<sent_balances>  sent_balances_by_output;
+    std::atomic<bool>      balance_refresh_requested{false};
+    name_key_set           system_accounts;
+    action_filter          whitelist;
+    action_filter          blacklist;
+    trace_cache                                   cached_traces;
+    uint64_t                                      reported_trace_evictions = 0;
+    account_extractor                             extractor;
+    vector<name>                                  action_accounts;
+    vector<name>                                  action_token_contracts;
+    uint32_t _end_block = 0;
+
+    bool                                          binary_encoding = false;
+    bool                                          streaming_json = false;
+    bool                                          batch_blocks = false;
+
+    // Action traces of every N blocks are sent in one columnar batch per
+    // output instead of individual messages. Disabled if zero.
+    uint32_t                                      columnar_blocks = 0;
+    uint32_t                                      columnar_pending_blocks = 0;
+    vector<columnar_batch>                        columnar_batches;
+
+    // With the schema registry, action data is not decoded. The ABI of
+    // every contract is sent once in a schema message instead, and again
+    // when it changes. Accessed on the chain thread only.
+    bool                                          schema_registry = false;
+    std::unordered_map<uint64_t, uint64_t>        sent_schemas;
+    std::atomic<bool>                             schemas_reset_requested{false};
+
+    // In irreversible-only mode, the messages of every accepted block wait
+    // here until the block becomes irreversible
+    struct reversible_block {
+      digest_type                                 digest;
+      vector<zmq_outgoing_message>                messages;
+      vector<columnar_batch>                      columnar;  // rows of the block, per output
+      bool                                        snapshot = false;  // taken again if discarded
+    };
+    bool                                          irreversible_only = false;
+
+    std::set<name>                                delta_contracts;
+    vector<name>                                  snapshot_contracts;
+    uint32_t                                      snapshot_chunk_size = SNAPSHOT_CHUNK_DEFAULT;
+    bool                                          snapshot_on_request = false;
+    std::atomic<bool>                             snapshot_requested{false};
+    std::map<block_num_type, reversible_block>    reversible_blocks;
+    reversible_block*                             current_block = nullptr;
+
+    uint32_t                                      queue_size = QUEUE_SIZE_DEFAULT;
+    overflow_policy                               policy = overflow_policy::block;
+    std::unique_ptr<spsc_ring<zmq_outgoing_message>> queue;
+    std::deque<zmq_outgoing_message>              spilled;
+    std::atomic<size_t>                           spilled_size{0};
+    std::mutex                                    spill_mtx;
+    uint64_t                                      dropped_messages = 0;
+    block_num_type                                dropped_first_block = 0;
+    std::thread                                   sender_thread;
+    std::atomic<bool>                             done{false};
+    std::atomic<bool>                             sender_idle{false};
+    std::atomic<bool>                             producer_waiting{false};
+    std::mutex                                    wait_mtx;
+    std::condition_variable                       wait_cv;
+
+    fc::optional<scoped_connection> applied_transaction_connection;
+    fc::optional<scoped_connection> accepted_block_connection;
+    fc::optional<scoped_connection> irreversible_block_connection;
+
+    zmq_plugin_impl();
+
+    // Applies the configuration and starts the threads. Returns false if
+    // the plugin is disabled. Defined in zmq_plugin.cpp with the options.
+    bool configure(const variables_map& options);
+
+    // Stops the threads and closes the sockets
+    void shutdown();
+
+    // Called on the chain thread only. The message is handed over to the
+    // sender thread, so a slow consumer does not stall block processing
+    // unless the overflow policy is "block".
+    buffer_ptr new_message();
+
+    static void write_header(zmq_outgoing_message& msg);
+
+    void send_msg( buffer_ptr content, int32_t msgtype, int32_t msgopts,
+                   uint64_t global_action_seq = 0, int32_t shard = -1 );
+
+    void enqueue( zmq_outgoing_message&& msg );
+
+    int32_t encoding_opts() const;
+
+    // options of the messages containing action traces
+    int32_t action_opts() const;
+
+    void reset_sent_balances();
+
+    // Called when messages are lost: the balances and schemas they may
+    // have contained are sent again
+    void forget_sent_state();
+
+    // The encoders append to the output string, so that a message is
+    // serialized directly into its pooled buffer after the header.
+    template<typename T>
+    void encode(const T& obj, string& out) const;
+
+    // In binary encoding, the action trace is packed as is, with action
+    // data left as raw bytes. The field order follows zmq_action_object.
+    template<typename Stream>
+    static void pack_action_object(Stream& ds, const zmq_action_object& zao, const action_trace& at);
+
+    void encode_action(const zmq_action_object& zao, const action_trace& at, string& out) const;
+
+    // A block batch contains the encoded accepted block object, followed by
+    // the encoded action traces and failed transactions of the block.
+    void encode_batch(const string& accepted, const vector<string>& action_traces,
+                      const vector<string>& failed_transactions, string& out) const;
+
+    void spill(zmq_outgoing_message& msg);
+
+    void notify_sender();
+
+    void poll_outputs();
+
+    void sender_loop();
+
+    // Sends one message, waiting for the socket to become writable. Returns
+    // false if the plugin is shutting down and the message could not be sent.
+    bool transmit(zmq_outgoing_message& msg);
+
+    void on_applied_transaction( const transaction_trace_ptr& p );
+
+    void on_accepted_block(const block_state_ptr& block_state);
+
+    // The Arrow IPC stream is binary regardless of the configured encoding
+    void send_columnar_batches();
+
+    void send_table_deltas( block_num_type block_num );
+
+    // The snapshot is taken on the chain thread at the end of a block, so
+    // the state does not change while the worker threads read it in
+    // chunks. Block processing is paused until all chunks are queued.
+    void send_snapshot( block_num_type block_num );
+
+    static string default_topic( int32_t msgtype );
+
+    // In PUB mode, messages that no subscriber would receive are skipped
+    bool topic_wanted( const string& topic, int32_t shard ) const;
+
+    int32_t shard_of( const action_trace& at, const vector<name>& accounts ) const;
+
+    // Fills in the parts of the action item that need the chain state.
+    // Returns false if the action is filtered out.
+    bool prepare_action( const action_trace& at, const block_state_ptr& block_state, block_item& item );
+
+    // Lists the schemas of the contracts in the trace, and sends the ones
+    // not sent yet
+    void collect_schemas( const action_trace& at, vector<zmq_schema_ref>& refs );
+
+    void send_schema( name account, uint64_t abi_sequence );
+
+    void serialize_actions( vector<block_item>& items );
+
+    template<typename Resolver>
+    void serialize_action( block_item& item, Resolver resolver ) const;
+
+    void collect_abis( const action_trace& at, std::unordered_map<uint64_t, abi_serializer_ref>& abis );
+
+    // Serves the subscription and the journal replay sockets
+    void control_loop();
+
+    void trim_journal();
+
+    // The reply is a multipart message. The first frame is a JSON object with
+    // the status and the journal index to continue from, and each following
+    // frame is a journaled message exactly as it was sent.
+    void handle_replay_request(const string& text);
+
+    // Requests are JSON objects with the "request" field naming the command.
+    // Runs on the control thread.
+    string handle_control_request(const string& text);
+
+    void publish_subscriptions();
+
+    abi_serializer_ref resolve_abi(const account_name& n);
+
+    void on_irreversible_block( const chain::block_state_ptr& bs );
+
+    // Sends the buffered messages of an irreversible block. Blocks below it
+    // that were not confirmed are discarded.
+    void release_block( block_num_type block_num, const digest_type& digest );
+
+    void release_columnar( reversible_block& rb );
+
+    // The blocks are not accepted again after a restart, so their messages
+    // are kept in a file until the plugin starts again. Called while the
+    // sender thread still runs, so that a loss can be reported.
+    void save_reversible_blocks( const bfs::path& file );
+
+    void load_reversible_blocks( const bfs::path& file );
+
+    // logs and sends a gap marker for messages that will never be sent
+    void report_lost_messages( uint64_t count, block_num_type first, block_num_type last );
+
+    void find_accounts_and_tokens(const action_trace& at,
+                                  vector<name>& accounts,
+                                  vector<name>& token_contracts);
+
+    // sorts the names and removes duplicates
+    static void make_unique(vector<name>& names);
+
+    bool is_account_of_interest(name account_name);
+
+    // sent is null unless only changed balances are reported
+    void add_account_resource( zmq_action_object& zao, name account_name, sent_balances* sent );
+
+    void add_currency_balances( zmq_action_object& zao,
+                                name account_name, name token_code, sent_balances* sent );
+  };
+}
+
+FC_REFLECT( eosio::fixture_abi,
+            (account)(abi_sequence)(abi) )
+
+FC_REFLECT( eosio::saved_message,
+            (msgtype)(msgopts)(global_action_seq)(shard)(topic)(content) )
+
+FC_REFLECT( eosio::saved_block,
+            (block_num)(digest)(messages)(columnar) )
+
+FC_REFLECT( zmqplugin::resource_balance,
+            (account_name)(ram_quota)(ram_usage)(net_weight)(cpu_weight)(net_limit)(cpu_limit) )
+
+FC_REFLECT( zmqplugin::currency_balance,
+            (account_name)(contract)(balance))
+
+FC_REFLECT( zmqplugin::zmq_action_object,
+            (global_action_seq)(block_num)(block_time)(action_trace)
+            (resource_balances)(currency_balances)(last_irreversible_block)(schemas) )
+
+FC_REFLECT( zmqplugin::zmq_schema_ref,
+            (account)(schema_id) )
+
+FC_REFLECT( zmqplugin::zmq_schema_object,
+            (account)(schema_id)(block_num)(abi) )
+
+FC_REFLECT( zmqplugin::zmq_irreversible_block_object,
+            (irreversible_block_num)(irreversible_block_digest) )
+
+FC_REFLECT( zmqplugin::zmq_fork_block_object,
+            (invalid_block_num) )
+
+FC_REFLECT( zmqplugin::zmq_accepted_block_object,
+            (accepted_block_num)(accepted_block_digest) )
+
+FC_REFLECT( zmqplugin::zmq_failed_transaction_object,
+            (trx_id)(block_num)(status_name)(status_int) )
+
+FC_REFLECT( zmqplugin::columnar_row,
+            (block_num)(block_time_ms)(global_action_seq)(trx_id)(receiver)(contract)(action)
+            (authorizations)(data)(resource_balances)(currency_balances) )
+
+FC_REFLECT( zmqplugin::zmq_table_delta,
+            (operation)(code)(scope)(table)(primary_key)(payer)(value) )
+
+FC_REFLECT( zmqplugin::zmq_table_deltas_object,
+            (block_num)(deltas) )
+
+FC_REFLECT( zmqplugin::zmq_subscription,
+            (consumer)(contracts)(actions)(accounts)(msgtypes) )
+
+FC_REFLECT( zmqplugin::zmq_gap_object,
+            (dropped_messages)(first_block_num)(last_block_num) )
+
+FC_REFLECT( zmqplugin::zmq_balance_snapshot_object,
+            (snapshot_block_num)(chunk)(chunks)(resource_balances)(currency_balances) )